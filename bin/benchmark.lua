@@ -0,0 +1,130 @@
+require "protolua"
+proto.parse("person.proto")
+proto.parse("track.proto")
+
+local function make_person(phone_count)
+    local person = {
+        name = "jinjiazh",
+        id = 10001,
+        email = "jinjiazh@qq.com",
+        phones = {},
+        scores = {},
+    }
+
+    for i = 1, phone_count do
+        person.phones[i] = {number = string.format("183****%04d", i), type = PhoneType.HOME}
+        person.scores["course"..i] = i
+    end
+    return person
+end
+
+-- timed with the alloc option off, then the lua allocations of a shorter run
+local function bench(name, count, func)
+    local start = os.clock()
+    for i = 1, count do
+        func()
+    end
+    local cost = os.clock() - start
+
+    local calls = math.min(count, 1000)
+    proto.option("alloc", true)
+    local before = proto.stats().lua_alloc
+    for i = 1, calls do
+        func()
+    end
+    local allocs = proto.stats().lua_alloc - before
+    proto.option("alloc", false)
+    print(string.format("%-32s %8d times %8.3f s %10.0f ops/s %8.1f allocs", name, count, cost, count / cost, allocs / calls))
+end
+
+local function run(title, person, count)
+    local data = proto.encode("Person", person)
+    local packed = proto.pack("Person", person.name, person.id, person.email)
+    print(string.format("%s, %d bytes", title, #data))
+
+    local Person = proto.type("Person")
+    for _, reflection in ipairs({true, false}) do
+        proto.option("reflection", reflection)
+        local path = reflection and "reflection" or "wire"
+        local stats = proto.stats()
+        bench(path.." encode", count, function() proto.encode("Person", person) end)
+        bench(path.." decode", count, function() proto.decode("Person", data) end)
+        bench(path.." type encode", count, function() Person:encode(person) end)
+        bench(path.." type decode", count, function() Person:decode(data) end)
+        bench(path.." pack", count, function() proto.pack("Person", person.name, person.id, person.email) end)
+        bench(path.." unpack", count, function() proto.unpack("Person", packed) end)
+        if reflection then
+            local after = proto.stats()
+            print(string.format("retained arena calls %d, of which went past its block to malloc %d",
+                after.arena_calls - stats.arena_calls, after.arena_overflow - stats.arena_overflow))
+        end
+    end
+    proto.option("reflection", false)
+    print()
+end
+
+-- packed varint runs of typed arrays, vector kernels against the scalar loop
+local widths = {
+    {"1 byte", function() return math.random(0, 127) end},
+    {"2 bytes", function() return math.random(128, 16383) end},
+    {"mixed", function() return math.random(0, 2 ^ math.random(0, 30)) end},
+    {"5 bytes", function() return math.random(2 ^ 28, 2 ^ 31 - 1) end},
+}
+
+local function run_packed(count, loops)
+    proto.option("array", true)
+    for _, width in ipairs(widths) do
+        local ids, deltas, stamps = proto.array("int32"), proto.array("int32"), proto.array("uint64")
+        for i = 1, count do
+            local value = width[2]()
+            ids[i] = value
+            deltas[i] = math.floor(value / 2) * (i % 2 == 0 and 1 or -1)
+            stamps[i] = value
+        end
+        local track = {ids = ids, deltas = deltas, stamps = stamps}
+        local data = proto.encode("Track", track)
+        print(string.format("packed %s, %d values a field, %d bytes", width[1], count, #data))
+        for _, simd in ipairs({true, false}) do
+            proto.option("simd", simd)
+            local kernel = proto.stats().varint
+            bench(kernel.." packed encode", loops, function() proto.encode("Track", track) end)
+            bench(kernel.." packed decode", loops, function() proto.decode("Track", data) end)
+        end
+        proto.option("simd", true)
+    end
+    proto.option("array", false)
+    print()
+end
+
+-- proto3 string fields checked by the vector kernel, the scalar one, or not at all
+local texts = {
+    {"ascii", string.rep("protocol buffers ", 64)},
+    {"cjk", string.rep("\228\184\173\230\150\135", 180)},
+}
+
+local function run_utf8(loops)
+    for _, text in ipairs(texts) do
+        local person = make_person(16)
+        person.name, person.email = text[2], text[2]
+        local data = proto.encode("Person", person)
+        print(string.format("utf8 %s, %d bytes", text[1], #data))
+        for _, mode in ipairs({{true, true}, {true, false}, {false, true}}) do
+            proto.option("utf8", mode[1])
+            proto.option("simd", mode[2])
+            local stats = proto.stats()
+            bench(stats.utf8.." utf8 decode", loops, function() proto.decode("Person", data) end)
+            local after = proto.stats()
+            print(string.format("strings checked %d, %d bytes, skipped %d", after.utf8_checked - stats.utf8_checked,
+                after.utf8_bytes - stats.utf8_bytes, after.utf8_skipped - stats.utf8_skipped))
+        end
+        proto.option("utf8", true)
+        proto.option("simd", true)
+    end
+    print()
+end
+
+run("small message", make_person(2), 100000)
+run("64KB message", make_person(2000), 200)
+run("1MB message", make_person(32000), 10)
+run_packed(10000, 2000)
+run_utf8(20000)
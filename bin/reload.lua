@@ -0,0 +1,62 @@
+-- proto.reload after one file of a large schema changed: the incremental
+-- reload builds the file and its importers again, a full one every file
+require "protolua"
+
+local FILE_COUNT = 1000
+local DIR = "reload"
+
+-- each file imports its parent in a binary tree, a change to file i
+-- rebuilds the path from i down to every leaf below it
+local function write_file(i, extra)
+    local lines = {'syntax = "proto3";', "package bench;"}
+    if i > 1 then
+        lines[#lines + 1] = string.format('import "r_%d.proto";', math.floor(i / 2))
+    end
+    lines[#lines + 1] = string.format("enum Kind%d { K%d_NONE = 0; K%d_ONE = 1; }", i, i, i)
+    lines[#lines + 1] = string.format("message M%d {", i)
+    lines[#lines + 1] = "    int32 id = 1; string name = 2; repeated int64 values = 3; map<string, int32> scores = 4;"
+    lines[#lines + 1] = string.format("    Kind%d kind = 5;", i)
+    if i > 1 then
+        lines[#lines + 1] = string.format("    M%d parent = 6;", math.floor(i / 2))
+    end
+    if extra then
+        lines[#lines + 1] = string.format("    int32 extra%d = 7;", extra)
+    end
+    lines[#lines + 1] = "}"
+
+    local file = assert(io.open(string.format("%s/r_%d.proto", DIR, i), "w"))
+    file:write(table.concat(lines, "\n"), "\n")
+    file:close()
+end
+
+local function bench(name, func)
+    local files = proto.stats().reload_files
+    local start = os.clock()
+    local result = func()
+    local cost = os.clock() - start
+    print(string.format("%-32s %8.3f s %6d files built again %s", name, cost, proto.stats().reload_files - files, tostring(result)))
+end
+
+os.execute("mkdir " .. DIR)
+for i = 1, FILE_COUNT do
+    write_file(i)
+end
+proto.map_path("", DIR .. "/")
+for i = 1, FILE_COUNT do
+    assert(proto.parse(string.format("r_%d.proto", i)))
+end
+
+-- a handle taken before the reloads still works after them
+local leaf = proto.type("bench.M" .. FILE_COUNT)
+local data = leaf:encode({id = 1, parent = {id = 2}})
+
+print(string.format("%d files, time, files built again", FILE_COUNT))
+bench("nothing changed", function() return proto.reload() end)
+write_file(FILE_COUNT, 1)
+bench("a leaf changed", function() return proto.reload() end)
+write_file(FILE_COUNT / 4, 2)
+bench("an inner file changed", function() return proto.reload() end)
+write_file(1, 3)
+bench("the root changed", function() return proto.reload() end)
+bench("full reload", function() return proto.reload(true) end)
+assert(leaf:decode(data).parent.id == 2)
@@ -0,0 +1,142 @@
+-- startup cost of a large schema: proto.parse on the .proto files, on one
+-- thread and on worker threads, against proto.load_descriptor_set on the
+-- same schema compiled by protoc
+require "protolua"
+
+local FILE_COUNT = 1000
+local THREADS = tonumber(arg and arg[1]) or 4
+local DIR = "startup"
+
+local function write_schema(prefix)
+    for i = 1, FILE_COUNT do
+        local lines = {'syntax = "proto3";', "package bench;"}
+        -- each file imports its parent and grandparent in a binary tree,
+        -- the files near the root are reached by many paths
+        local deps = {}
+        if i > 1 then
+            deps[#deps + 1] = math.floor(i / 2)
+        end
+        if i > 3 then
+            deps[#deps + 1] = math.floor(i / 4)
+        end
+        for _, dep in ipairs(deps) do
+            lines[#lines + 1] = string.format('import "%s_%d.proto";', prefix, dep)
+        end
+
+        lines[#lines + 1] = string.format("enum %s_Kind%d { %s_K%d_NONE = 0; %s_K%d_ONE = 1; %s_K%d_TWO = 2; }",
+            prefix, i, prefix, i, prefix, i, prefix, i)
+        for m = 1, 3 do
+            lines[#lines + 1] = string.format("message %s_M%d_%d {", prefix, i, m)
+            lines[#lines + 1] = "    int32 id = 1; string name = 2; repeated int64 values = 3; map<string, int32> scores = 4;"
+            lines[#lines + 1] = string.format("    %s_Kind%d kind = 5; bytes blob = 6; double ratio = 7;", prefix, i)
+            for n, dep in ipairs(deps) do
+                lines[#lines + 1] = string.format("    %s_M%d_%d ref%d = %d;", prefix, dep, m, n, 7 + n)
+            end
+            lines[#lines + 1] = "}"
+        end
+
+        local file = assert(io.open(string.format("%s/%s_%d.proto", DIR, prefix, i), "w"))
+        file:write(table.concat(lines, "\n"), "\n")
+        file:close()
+    end
+end
+
+-- resident memory in KB, from /proc where there is one
+local function resident()
+    local file = io.open("/proc/self/status", "r")
+    if not file then
+        return nil
+    end
+    local text = file:read("*a")
+    file:close()
+    return tonumber(string.match(text, "VmRSS:%s*(%d+)"))
+end
+
+-- os.clock is the cpu time of all threads, parse_all prints the wall time
+local function bench(name, func, files)
+    collectgarbage()
+    local memory = resident()
+    local start = os.clock()
+    local result = func()
+    local cost = os.clock() - start
+    local grown = memory and string.format("%8d KB", resident() - memory) or "     n/a"
+    print(string.format("%-28s %8.3f s %8.1f us/file %s %s", name, cost, cost * 1e6 / (files or FILE_COUNT), grown, tostring(result)))
+end
+
+local function compile(prefix)
+    local files = {}
+    for i = 1, FILE_COUNT do
+        files[i] = string.format("%s/%s_%d.proto", DIR, prefix, i)
+    end
+    local path = string.format("%s/%s.desc", DIR, prefix)
+    local command = string.format("protoc -I %s --include_imports --descriptor_set_out=%s %s", DIR, path, table.concat(files, " "))
+    local result = os.execute(command)
+    if result ~= true and result ~= 0 then
+        print("protoc failed, the descriptor set is not measured: " .. command)
+        return nil
+    end
+    return path
+end
+
+local function parse_each(prefix)
+    for i = 1, FILE_COUNT do
+        if not proto.parse(string.format("%s_%d.proto", prefix, i)) then
+            return false
+        end
+    end
+    return true
+end
+
+local function parse_all(prefix)
+    local result, report = proto.parse_all(DIR, prefix .. "_*.proto")
+    local slowest, cost = nil, 0
+    for file, time in pairs(report.files) do
+        if time > cost then
+            slowest, cost = file, time
+        end
+    end
+    print(string.format("parse_all %d files %.3f s, enums %.3f s, slowest %s %.3f s",
+        report.count, report.total, report.traverse, tostring(slowest), cost))
+    return result
+end
+
+-- the first message of a type from the deepest file, which builds its
+-- imports too in lazy mode
+local function first_request(prefix)
+    local name = string.format("bench.%s_M%d_1", prefix, FILE_COUNT)
+    local data = proto.encode(name, {id = 1, name = "first", kind = _G[prefix .. "_Kind" .. FILE_COUNT].ONE})
+    return proto.decode(name, data).id == 1
+end
+
+os.execute("mkdir " .. DIR)
+for _, prefix in ipairs({"text", "batch", "threads", "set", "lazytext", "lazythreads", "lazyset"}) do
+    write_schema(prefix)
+end
+local set_path = compile("set")
+local lazy_path = compile("lazyset")
+
+print(string.format("%d files, time, per file, resident memory", FILE_COUNT))
+proto.map_path("", DIR .. "/")
+proto.option("lazy", true)
+bench("lazy parse .proto", function() return parse_each("lazytext") end)
+bench("lazy first request", function() return first_request("lazytext") end, 1)
+proto.option("threads", THREADS)
+bench(string.format("lazy parse_all, %d threads", THREADS), function() return parse_all("lazythreads") end)
+proto.option("threads", 0)
+if lazy_path then
+    bench("lazy load descriptor set", function() return proto.load_descriptor_set(lazy_path) end)
+    bench("lazy first request", function() return first_request("lazyset") end, 1)
+end
+
+proto.option("lazy", false)
+bench("parse .proto", function() return parse_each("text") end)
+bench("first request", function() return first_request("text") end, 1)
+bench("parse_all .proto", function() return parse_all("batch") end)
+proto.option("threads", THREADS)
+bench(string.format("parse_all, %d threads", THREADS), function() return parse_all("threads") end)
+bench("first request", function() return first_request("threads") end, 1)
+if set_path then
+    bench("load descriptor set", function() return proto.load_descriptor_set(set_path) end)
+    bench("first request", function() return first_request("set") end, 1)
+end
+bench("reload", function() return proto.reload() end)
@@ -0,0 +1,70 @@
+#ifndef _JINJIAZHANG_PROTOARENA_H_
+#define _JINJIAZHANG_PROTOARENA_H_
+
+#include "google/protobuf/arena.h"
+#include "google/protobuf/message.h"
+#include "plan.h"
+
+#define PROTO_ARENA_BLOCK (64 * 1024)
+
+// arena for the messages of the reflection path, taken on first get(). the
+// outermost call on a thread gets an arena whose first block is kept and
+// which is reset when the call ends, a call nested in it (from a metamethod)
+// gets its own
+class MessageArena
+{
+public:
+    MessageArena() : arena_(NULL), retained_(false) {}
+    ~MessageArena();
+
+    google::protobuf::Arena* get();
+
+private:
+    MessageArena(const MessageArena&);
+    MessageArena& operator=(const MessageArena&);
+
+private:
+    google::protobuf::Arena* arena_;
+    bool retained_;
+};
+
+// the message of a reflection call. with pooling on it comes from the free
+// list of its plan and is cleared and put back afterwards, keeping its field
+// capacity, otherwise it lives on the arena
+class ReflectMessage
+{
+public:
+    ReflectMessage(const ProtoPlan* plan, const google::protobuf::Message* prototype);
+    ~ReflectMessage();
+
+    google::protobuf::Message* get() { return message_; }
+
+private:
+    ReflectMessage(const ReflectMessage&);
+    ReflectMessage& operator=(const ReflectMessage&);
+
+private:
+    const ProtoPlan* plan_;
+    google::protobuf::Message* message_;
+    bool pooled_;
+    MessageArena arena_;
+};
+
+// the lua side of a reflection call, run under lua_pcall by reflect_call.
+// a lua error raised in it (by a metamethod) comes back to the caller, which
+// releases the message and the arena before passing it on with lua_error,
+// a longjmp past them would leave the retained arena taken for good
+struct ReflectCall
+{
+    const ProtoPlan* plan;
+    google::protobuf::Message* message;
+    int count;      // lua values handed over, the table of an encode or the values of a pack
+    bool pack;      // field by field in plan->sorted order
+    bool result;
+};
+
+// call func with the call and the count values at start, what it pushes is
+// left on the stack. a lua error gives its status with the error on top
+int reflect_call(lua_State* L, lua_CFunction func, ReflectCall* call, int start);
+
+#endif
@@ -0,0 +1,156 @@
+#ifndef _JINJIAZHANG_PROTOARRAY_H_
+#define _JINJIAZHANG_PROTOARRAY_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include "lua.hpp"
+
+#define PROTO_ARRAY_META "protolua.array"
+
+enum ArrayType
+{
+    ARRAY_NONE = -1,
+    ARRAY_INT32,
+    ARRAY_UINT32,
+    ARRAY_INT64,
+    ARRAY_UINT64,
+    ARRAY_FLOAT,
+    ARRAY_DOUBLE,
+};
+
+// contiguous elements of a repeated numeric field, kept in a lua userdata
+// instead of a table holding one TValue per element
+class ProtoArray
+{
+public:
+    ProtoArray(ArrayType type) : type_(type), data_(NULL), size_(0), capacity_(0) {}
+    ~ProtoArray() { free(data_); }
+
+    ArrayType type() const { return type_; }
+    size_t size() const { return size_; }
+    size_t width() const { return type_ == ARRAY_INT64 || type_ == ARRAY_UINT64 || type_ == ARRAY_DOUBLE ? 8 : 4; }
+    char* data() { return data_; }
+    bool integer() const { return type_ != ARRAY_FLOAT && type_ != ARRAY_DOUBLE; }
+
+    // make room for n more elements
+    bool reserve(size_t n)
+    {
+        if (size_ + n <= capacity_)
+            return true;
+
+        size_t capacity = capacity_ ? capacity_ * 2 : 16;
+        while (capacity < size_ + n)
+            capacity *= 2;
+
+        char* data = (char*)realloc(data_, capacity * width());
+        if (data == NULL)
+            return false;
+        data_ = data;
+        capacity_ = capacity;
+        return true;
+    }
+
+    // caller must reserve first, n elements written in place at the end
+    char* tail() { return data_ + size_ * width(); }
+    void advance(size_t n) { size_ += n; }
+
+    bool push_integer(long long value)
+    {
+        if (!reserve(1))
+            return false;
+        set_integer(size_++, value);
+        return true;
+    }
+
+    bool push_number(double value)
+    {
+        if (!reserve(1))
+            return false;
+        set_number(size_++, value);
+        return true;
+    }
+
+    long long get_integer(size_t i) const
+    {
+        switch (type_)
+        {
+        case ARRAY_INT32: return ((const int*)data_)[i];
+        case ARRAY_UINT32: return ((const unsigned int*)data_)[i];
+        case ARRAY_INT64: return ((const long long*)data_)[i];
+        case ARRAY_UINT64: return (long long)((const unsigned long long*)data_)[i];
+        case ARRAY_FLOAT: return (long long)((const float*)data_)[i];
+        default: return (long long)((const double*)data_)[i];
+        }
+    }
+
+    double get_number(size_t i) const
+    {
+        switch (type_)
+        {
+        case ARRAY_FLOAT: return ((const float*)data_)[i];
+        case ARRAY_DOUBLE: return ((const double*)data_)[i];
+        case ARRAY_UINT64: return (double)((const unsigned long long*)data_)[i];
+        default: return (double)get_integer(i);
+        }
+    }
+
+    void set_integer(size_t i, long long value)
+    {
+        switch (type_)
+        {
+        case ARRAY_INT32: ((int*)data_)[i] = (int)value; break;
+        case ARRAY_UINT32: ((unsigned int*)data_)[i] = (unsigned int)value; break;
+        case ARRAY_INT64: ((long long*)data_)[i] = value; break;
+        case ARRAY_UINT64: ((unsigned long long*)data_)[i] = (unsigned long long)value; break;
+        case ARRAY_FLOAT: ((float*)data_)[i] = (float)value; break;
+        default: ((double*)data_)[i] = (double)value; break;
+        }
+    }
+
+    void set_number(size_t i, double value)
+    {
+        if (type_ == ARRAY_FLOAT)
+            ((float*)data_)[i] = (float)value;
+        else if (type_ == ARRAY_DOUBLE)
+            ((double*)data_)[i] = value;
+        else
+            set_integer(i, (long long)value);
+    }
+
+private:
+    ProtoArray(const ProtoArray&);
+    ProtoArray& operator=(const ProtoArray&);
+
+private:
+    ArrayType type_;
+    char* data_;
+    size_t size_;
+    size_t capacity_;
+};
+
+// on a little endian host the elements of an array are the wire bytes of
+// a packed fixed width field
+inline bool array_little_endian()
+{
+    const unsigned short one = 1;
+    return *(const unsigned char*)&one == 1;
+}
+
+inline ProtoArray* array_new(lua_State* L, ArrayType type)
+{
+    ProtoArray* array = new (lua_newuserdata(L, sizeof(ProtoArray))) ProtoArray(type);
+    luaL_getmetatable(L, PROTO_ARRAY_META);
+    lua_setmetatable(L, -2);
+    return array;
+}
+
+// the array at index, null when it isn't one
+inline ProtoArray* array_test(lua_State* L, int index)
+{
+    if (lua_type(L, index) != LUA_TUSERDATA)
+        return NULL;
+    return (ProtoArray*)luaL_testudata(L, index, PROTO_ARRAY_META);
+}
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef _JINJIAZHANG_PROTOBUFFER_H_
+#define _JINJIAZHANG_PROTOBUFFER_H_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+// growable byte buffer used as wire output, it can also wrap a caller
+// supplied memory block, in which case it never grows
+class ProtoBuffer
+{
+public:
+    ProtoBuffer() : data_(local_), size_(0), capacity_(sizeof(local_)), fixed_(false) {}
+    ProtoBuffer(char* output, size_t size) : data_(output), size_(0), capacity_(size), fixed_(true) {}
+    ~ProtoBuffer() { if (data_ != local_ && !fixed_) free(data_); }
+
+    char* data() { return data_; }
+    size_t size() const { return size_; }
+    size_t capacity() const { return capacity_; }
+    void clear() { size_ = 0; }
+    void truncate(size_t size) { if (size < size_) size_ = size; }
+
+    // make room for n more bytes at the end of the buffer
+    bool reserve(size_t n)
+    {
+        if (size_ + n <= capacity_)
+            return true;
+        return grow(size_ + n);
+    }
+
+    // caller must reserve first
+    char* tail() { return data_ + size_; }
+    void advance(size_t n) { size_ += n; }
+
+    bool append(const char* bytes, size_t n)
+    {
+        if (!reserve(n))
+            return false;
+        memcpy(data_ + size_, bytes, n);
+        size_ += n;
+        return true;
+    }
+
+    // give the heap block back once it went past limit
+    void shrink(size_t limit)
+    {
+        size_ = 0;
+        if (fixed_ || data_ == local_ || capacity_ <= limit)
+            return;
+        free(data_);
+        data_ = local_;
+        capacity_ = sizeof(local_);
+    }
+
+private:
+    bool grow(size_t need)
+    {
+        if (fixed_)
+            return false;
+
+        size_t capacity = capacity_ * 2;
+        while (capacity < need)
+            capacity *= 2;
+
+        char* data = (char*)(data_ == local_ ? malloc(capacity) : realloc(data_, capacity));
+        if (data == NULL)
+            return false;
+        if (data_ == local_)
+            memcpy(data, local_, size_);
+
+        data_ = data;
+        capacity_ = capacity;
+        return true;
+    }
+
+    ProtoBuffer(const ProtoBuffer&);
+    ProtoBuffer& operator=(const ProtoBuffer&);
+
+private:
+    char* data_;
+    size_t size_;
+    size_t capacity_;
+    bool fixed_;
+    char local_[256];
+};
+
+// the output buffer kept between encode calls on a thread so its memory is
+// reused, an encode nested inside another one (from a metamethod) gets its
+// own. a lua error longjmps past the destructor of the owner, its frame is
+// gone once a new one is at or above it (the stack grows down) and the
+// buffer is taken over
+class ScratchBuffer
+{
+public:
+    ScratchBuffer() : retained_(owner_ == 0 || owner_ <= (uintptr_t)this)
+    {
+        if (!retained_)
+            return;
+        owner_ = (uintptr_t)this;
+        retained_buffer_.clear();
+    }
+
+    ~ScratchBuffer()
+    {
+        if (!retained_)
+            return;
+        retained_buffer_.shrink(limit_);
+        owner_ = 0;
+    }
+
+    ProtoBuffer& buffer() { return retained_ ? retained_buffer_ : local_; }
+
+private:
+    ScratchBuffer(const ScratchBuffer&);
+    ScratchBuffer& operator=(const ScratchBuffer&);
+
+private:
+    bool retained_;
+    ProtoBuffer local_;
+
+    static thread_local uintptr_t owner_;  // address of the one using the retained buffer
+    static thread_local ProtoBuffer retained_buffer_;
+    static const size_t limit_ = 1024 * 1024;
+};
+
+#endif
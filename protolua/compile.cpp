@@ -0,0 +1,200 @@
+#include "protolua.h"
+#include "importer.h"
+#include <map>
+#include <algorithm>
+#include <deque>
+#include <memory>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "google/protobuf/io/tokenizer.h"
+#include "google/protobuf/io/zero_copy_stream.h"
+
+using namespace google::protobuf;
+using namespace google::protobuf::compiler;
+
+// keeps the errors of a file until they are reported on the calling thread.
+// warnings are dropped like SourceTreeDescriptorDatabase does
+class ParseErrorBuffer : public io::ErrorCollector
+{
+public:
+    ParseErrorBuffer(ParsedFile* parsed) : parsed_(parsed) {}
+
+    bool had_errors() const { return !parsed_->errors.empty(); }
+
+    void AddError(int line, io::ColumnNumber column, const std::string& message)
+    {
+        ParseError error;
+        error.line = line;
+        error.column = column;
+        error.message = message;
+        parsed_->errors.push_back(error);
+    }
+
+private:
+    ParsedFile* parsed_;
+};
+
+struct CompileQueue
+{
+    std::mutex mutex;
+    std::condition_variable ready;
+    std::deque<ParsedFile*> pending;
+    std::set<std::string> seen;
+    std::vector<ParsedFile*> done;
+    int busy;           // files being parsed, their imports aren't queued yet
+    bool locate;        // record source locations for the errors of the build
+    ProtoImporter* importer;
+    SourceTree* source_tree;
+};
+
+// with the queue locked
+static void enqueue(CompileQueue* queue, const std::string& filename)
+{
+    if (!queue->seen.insert(filename).second || queue->importer->HasFile(filename))
+        return;
+
+    ParsedFile* parsed = new ParsedFile();
+    parsed->name = filename;
+    parsed->output = NULL;
+    parsed->failed = false;
+    parsed->broken = false;
+    parsed->seconds = 0;
+    queue->pending.push_back(parsed);
+}
+
+// what SourceTreeDescriptorDatabase does for a file, the source tree is
+// shared so it is only opened with the queue locked
+static void parse_source(CompileQueue* queue, ParsedFile* parsed)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::unique_ptr<io::ZeroCopyInputStream> input;
+    {
+        std::lock_guard<std::mutex> lock(queue->mutex);
+        input.reset(queue->source_tree->Open(parsed->name));
+        if (input == NULL)
+        {
+            ParseError error;
+            error.line = -1;
+            error.column = 0;
+            error.message = queue->source_tree->GetLastErrorMessage();
+            parsed->errors.push_back(error);
+        }
+    }
+
+    if (input != NULL)
+    {
+        ParseErrorBuffer errors(parsed);
+        io::Tokenizer tokenizer(input.get(), &errors);
+        Parser parser;
+        parser.RecordErrorsTo(&errors);
+        if (queue->locate)
+            parser.RecordSourceLocationsTo(&parsed->locations);
+        parsed->file.set_name(parsed->name);
+        parsed->failed = !parser.Parse(&tokenizer, &parsed->file) || errors.had_errors();
+    }
+    else
+    {
+        parsed->failed = true;
+    }
+    parsed->seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static void compile_worker(CompileQueue* queue)
+{
+    std::unique_lock<std::mutex> lock(queue->mutex);
+    while (true)
+    {
+        // a file being parsed may still queue its imports
+        while (queue->pending.empty() && queue->busy > 0)
+            queue->ready.wait(lock);
+        if (queue->pending.empty())
+            break;
+
+        ParsedFile* parsed = queue->pending.front();
+        queue->pending.pop_front();
+        queue->busy++;
+        lock.unlock();
+        parse_source(queue, parsed);
+        lock.lock();
+
+        queue->busy--;
+        queue->done.push_back(parsed);
+        int dep_count = parsed->file.dependency_size();
+        for (int i = 0; i < dep_count; i++)
+        {
+            enqueue(queue, parsed->file.dependency(i));
+        }
+        queue->ready.notify_all();
+    }
+}
+
+// imports first, a file is broken when it or one of its imports failed
+static bool sort_file(ParsedFile* parsed, std::map<std::string, ParsedFile*>& files, std::set<std::string>* visited, std::vector<ParsedFile*>* sorted)
+{
+    if (!visited->insert(parsed->name).second)
+        return parsed->broken;
+
+    parsed->broken = parsed->failed;
+    int dep_count = parsed->file.dependency_size();
+    for (int i = 0; i < dep_count; i++)
+    {
+        std::map<std::string, ParsedFile*>::iterator it = files.find(parsed->file.dependency(i));
+        if (it != files.end() && sort_file(it->second, files, visited, sorted))
+            parsed->broken = true;
+    }
+    sorted->push_back(parsed);
+    return parsed->broken;
+}
+
+void compile_sources(ProtoImporter* importer, SourceTree* source_tree, MultiFileErrorCollector* collector,
+    const std::vector<std::string>& files, int threads, bool locate, std::vector<ParsedFile*>* sorted)
+{
+    CompileQueue queue;
+    queue.busy = 0;
+    queue.locate = locate;
+    queue.importer = importer;
+    queue.source_tree = source_tree;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        enqueue(&queue, files[i]);
+    }
+
+    // no more workers than files to start with, the rest would wait for imports
+    int count = std::max(1, std::min(threads, (int)queue.pending.size()));
+    std::vector<std::thread> workers;
+    for (int i = 0; i < count; i++)
+    {
+        workers.push_back(std::thread(compile_worker, &queue));
+    }
+    for (int i = 0; i < count; i++)
+    {
+        workers[i].join();
+    }
+
+    std::map<std::string, ParsedFile*> parsed;
+    for (size_t i = 0; i < queue.done.size(); i++)
+    {
+        parsed[queue.done[i]->name] = queue.done[i];
+    }
+
+    std::set<std::string> visited;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        std::map<std::string, ParsedFile*>::iterator it = parsed.find(files[i]);
+        if (it != parsed.end())
+            sort_file(it->second, parsed, &visited, sorted);
+    }
+
+    // in the order the files are built, like a single thread reports them
+    for (size_t i = 0; i < sorted->size(); i++)
+    {
+        ParsedFile* file = (*sorted)[i];
+        for (size_t j = 0; j < file->errors.size(); j++)
+        {
+            const ParseError& error = file->errors[j];
+            collector->AddError(file->name, error.line, error.column, error.message);
+        }
+    }
+}
@@ -8,6 +8,7 @@ bool decode_required(const Message& message, const FieldDescriptor* field, lua_S
 bool decode_optional(const Message& message, const FieldDescriptor* field, lua_State* L);
 bool decode_repeated(const Message& message, const FieldDescriptor* field, lua_State* L);
 bool decode_table(const Message& message, const FieldDescriptor* field, lua_State* L);
+bool decode_array(const Message& message, const FieldDescriptor* field, ArrayType type, lua_State* L);
 bool decode_single(const Message& message, const FieldDescriptor* field, lua_State* L);
 bool decode_multiple(const Message& message, const FieldDescriptor* field, lua_State* L, int index);
 bool decode_message(const Message& message, const Descriptor* descriptor, lua_State* L);
@@ -39,7 +40,8 @@ bool decode_required(const Message& message, const FieldDescriptor* field, lua_S
 bool decode_optional(const Message& message, const FieldDescriptor* field, lua_State* L)
 {
     const Reflection* reflection = message.GetReflection();
-    if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE && !reflection->HasField(message, field)) {
+    bool presence = field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE || field->containing_oneof();
+    if (presence && !reflection->HasField(message, field)) {
         lua_pushnil(L);
         return true;
     }
@@ -49,6 +51,10 @@ bool decode_optional(const Message& message, const FieldDescriptor* field, lua_S
 
 bool decode_repeated(const Message& message, const FieldDescriptor* field, lua_State* L)
 {
+    ArrayType type = g_options.array ? field_array(field) : ARRAY_NONE;
+    if (type != ARRAY_NONE)
+        return decode_array(message, field, type, L);
+
     const Reflection* reflection = message.GetReflection();
     int field_size = reflection->FieldSize(message, field);
     lua_createtable(L, field_size, 0);
@@ -60,6 +66,78 @@ bool decode_repeated(const Message& message, const FieldDescriptor* field, lua_S
     return true;
 }
 
+bool decode_array(const Message& message, const FieldDescriptor* field, ArrayType type, lua_State* L)
+{
+    const Reflection* reflection = message.GetReflection();
+    int field_size = reflection->FieldSize(message, field);
+    ProtoArray* array = array_new(L, type);
+    PROTO_DO(array->reserve(field_size));
+    for (int index = 0; index < field_size; index++)
+    {
+        switch (field->cpp_type())
+        {
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+            array->push_number(reflection->GetRepeatedDouble(message, field, index));
+            break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+            array->push_number(reflection->GetRepeatedFloat(message, field, index));
+            break;
+        case FieldDescriptor::CPPTYPE_INT32:
+            array->push_integer(reflection->GetRepeatedInt32(message, field, index));
+            break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+            array->push_integer(reflection->GetRepeatedUInt32(message, field, index));
+            break;
+        case FieldDescriptor::CPPTYPE_INT64:
+            array->push_integer(reflection->GetRepeatedInt64(message, field, index));
+            break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+            array->push_integer((int64)reflection->GetRepeatedUInt64(message, field, index));
+            break;
+        default:
+            proto_error("decode_array field isn't numeric, field=%s", field->full_name().c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// the array part of a map keyed 1..n (with at most half of it unused),
+// 0 when the keys aren't integers or aren't dense
+int dense_size(const Message& message, const FieldDescriptor* field, const FieldDescriptor* key, int field_size)
+{
+    const Reflection* reflection = message.GetReflection();
+    int64 max_key = 0;
+    for (int index = 0; index < field_size; index++)
+    {
+        const Message& submessage = reflection->GetRepeatedMessage(message, field, index);
+        const Reflection* entry = submessage.GetReflection();
+        int64 key_value = 0;
+        switch (key->cpp_type())
+        {
+        case FieldDescriptor::CPPTYPE_INT32:
+            key_value = entry->GetInt32(submessage, key);
+            break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+            key_value = entry->GetUInt32(submessage, key);
+            break;
+        case FieldDescriptor::CPPTYPE_INT64:
+            key_value = entry->GetInt64(submessage, key);
+            break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+            key_value = (int64)entry->GetUInt64(submessage, key);
+            break;
+        default:
+            return 0;
+        }
+
+        if (key_value <= 0 || key_value > 2 * (int64)field_size)
+            return 0;
+        max_key = key_value > max_key ? key_value : max_key;
+    }
+    return (int)max_key;
+}
+
 bool decode_table(const Message& message, const FieldDescriptor* field, lua_State* L)
 {
     const Reflection* reflection = message.GetReflection();
@@ -70,13 +148,18 @@ bool decode_table(const Message& message, const FieldDescriptor* field, lua_Stat
     const FieldDescriptor* key = descriptor->field(0);
     const FieldDescriptor* value = descriptor->field(1);
 
-    lua_createtable(L, 0, field_size);
+    int array_size = g_options.dense ? dense_size(message, field, key, field_size) : 0;
+    if (array_size > 0)
+        lua_createtable(L, array_size, 0);
+    else
+        lua_createtable(L, 0, field_size);
+
     for (int index = 0; index < field_size; index++)
     {
         const Message& submessage = reflection->GetRepeatedMessage(message, field, index);
         PROTO_DO(decode_field(submessage, key, L));
         PROTO_DO(decode_field(submessage, value, L));
-        lua_settable(L, -3);
+        lua_rawset(L, -3);
     }
     return true;
 }
@@ -179,72 +262,131 @@ bool decode_multiple(const Message& message, const FieldDescriptor* field, lua_S
 
 bool decode_message(const Message& message, const Descriptor* descriptor, lua_State* L)
 {
+    const ProtoPlan* plan = proto_plan(descriptor);
+    PROTO_ASSERT(plan);
+
     int field_count = descriptor->field_count();
     lua_createtable(L, 0, field_count);
+    int index = lua_gettop(L);
+    proto_push_names(plan, L);
+    int names = lua_gettop(L);
+    const Reflection* reflection = message.GetReflection();
     for (int i = 0; i < field_count; i++)
     {
         const FieldDescriptor* field = descriptor->field(i);
+        // only the active member of a oneof is there
+        if (field->containing_oneof() && !reflection->HasField(message, field))
+            continue;
+
+        if (g_options.sparse && !field->is_required())
+        {
+            // absent, or a proto3 field at its default
+            if (field->is_repeated() ? reflection->FieldSize(message, field) == 0 : !reflection->HasField(message, field))
+                continue;
+        }
+
+        plan_pushname(L, names, &plan->fields[i]);
         PROTO_DO(decode_field(message, field, L));
-        lua_setfield(L, -2, field->name().c_str());
+        lua_rawset(L, index);
+    }
+    lua_pop(L, 1);
+
+    if (g_options.sparse)
+    {
+        PROTO_DO(proto_push_defaults(plan, L));
+        lua_setmetatable(L, index);
     }
     return true;
 }
 
+bool read_create(const ProtoPlan* plan, lua_State* L, int depth);
+bool proto_create(const ProtoType* type, lua_State* L)
+{
+    return read_create(type->plan, L, 0);
+}
+
 bool proto_create(const char* proto, lua_State* L)
 {
-    const Descriptor* descriptor = g_importer->pool()->FindMessageTypeByName(proto);
-    PROTO_ASSERT(descriptor);
+    ProtoType type;
+    PROTO_DO(proto_resolve(proto, &type));
+    return proto_create(&type, L);
+}
 
-    const Message* prototype = g_factory->GetPrototype(descriptor);
-    PROTO_ASSERT(prototype);
+// push the table of call->message, or its fields one by one
+static int decode_call(lua_State* L)
+{
+    ReflectCall* call = (ReflectCall*)lua_touserdata(L, 1);
+    const ProtoPlan* plan = call->plan;
+    if (!call->pack)
+    {
+        call->result = decode_message(*call->message, plan->descriptor, L);
+        return lua_gettop(L) - 1;
+    }
 
-    std::unique_ptr<Message> message(prototype->New());
-    int field_count = descriptor->field_count();
-    lua_createtable(L, 0, field_count);
-    for (int i = 0; i < field_count; i++)
+    call->result = lua_checkstack(L, plan->field_count) != 0;
+    for (int i = 0; i < plan->field_count && call->result; i++)
     {
-        const FieldDescriptor* field = descriptor->field(i);
-        if (field->is_map() || field->is_repeated())
-            lua_newtable(L);
-        else if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
-            PROTO_DO(proto_create(field->message_type()->full_name().c_str(), L))
-        else
-            PROTO_DO(decode_single(*message.get(), field, L))
-        lua_setfield(L, -2, field->name().c_str());
+        call->result = decode_field(*call->message, plan->sorted[i]->field, L);
     }
-    return true;
+    return lua_gettop(L) - 1;
 }
 
-bool proto_decode(const char* proto, lua_State* L, const char* input, size_t size)
+bool read_proto(const ProtoPlan* plan, lua_State* L, const char* input, size_t size);
+bool proto_decode(const ProtoType* type, lua_State* L, const char* input, size_t size)
 {
-    const Descriptor* descriptor = g_importer->pool()->FindMessageTypeByName(proto);
-    PROTO_ASSERT(descriptor);
+    if (!g_options.reflection)
+        return read_proto(type->plan, L, input, size);
 
-    const Message* prototype = g_factory->GetPrototype(descriptor);
+    const Message* prototype = type->prototype ? type->prototype : g_factory->GetPrototype(type->descriptor);
     PROTO_ASSERT(prototype);
 
-    std::unique_ptr<Message> message(prototype->New());
-    PROTO_DO(message->ParseFromArray(input, size));
-    return decode_message(*message.get(), descriptor, L);
+    int status = 0;
+    bool result = false;
+    {
+        ReflectMessage holder(type->plan, prototype);
+        ReflectCall call = { type->plan, holder.get(), 0, false, false };
+        PROTO_DO(holder.get()->ParseFromArray(input, size));
+        status = reflect_call(L, decode_call, &call, 0);
+        result = status == 0 && call.result;
+    }
+    if (status != 0)
+        lua_error(L);
+    return result;
 }
 
-std::vector<const FieldDescriptor*> SortFieldsByNumber(const Descriptor* descriptor);
-bool proto_unpack(const char* proto, lua_State* L, const char* input, size_t size)
+bool proto_decode(const char* proto, lua_State* L, const char* input, size_t size)
 {
-    const Descriptor* descriptor = g_importer->pool()->FindMessageTypeByName(proto);
-    PROTO_ASSERT(descriptor);
+    ProtoType type;
+    PROTO_DO(proto_resolve(proto, &type));
+    return proto_decode(&type, L, input, size);
+}
 
-    const Message* prototype = g_factory->GetPrototype(descriptor);
-    PROTO_ASSERT(prototype);
+bool read_unpack(const ProtoPlan* plan, lua_State* L, const char* input, size_t size);
+bool proto_unpack(const ProtoType* type, lua_State* L, const char* input, size_t size)
+{
+    if (!g_options.reflection)
+        return read_unpack(type->plan, L, input, size);
 
-    std::unique_ptr<Message> message(prototype->New());
-    PROTO_DO(message->ParseFromArray(input, size));
+    const Message* prototype = type->prototype ? type->prototype : g_factory->GetPrototype(type->descriptor);
+    PROTO_ASSERT(prototype);
 
-    std::vector<const FieldDescriptor*> fields = SortFieldsByNumber(descriptor);
-    for (int i = 0; i < (int)fields.size(); i++)
+    int status = 0;
+    bool result = false;
     {
-        const FieldDescriptor* field = fields[i];
-        PROTO_DO(decode_field(*message.get(), field, L));
+        ReflectMessage holder(type->plan, prototype);
+        ReflectCall call = { type->plan, holder.get(), 0, true, false };
+        PROTO_DO(holder.get()->ParseFromArray(input, size));
+        status = reflect_call(L, decode_call, &call, 0);
+        result = status == 0 && call.result;
     }
-    return true;
-}
\ No newline at end of file
+    if (status != 0)
+        lua_error(L);
+    return result;
+}
+
+bool proto_unpack(const char* proto, lua_State* L, const char* input, size_t size)
+{
+    ProtoType type;
+    PROTO_DO(proto_resolve(proto, &type));
+    return proto_unpack(&type, L, input, size);
+}
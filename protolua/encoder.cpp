@@ -1,4 +1,5 @@
 #include "protolua.h"
+#include <algorithm>
 
 using namespace google::protobuf;
 using namespace google::protobuf::compiler;
@@ -8,10 +9,92 @@ bool encode_required(Message* message, const FieldDescriptor* field, lua_State*
 bool encode_optional(Message* message, const FieldDescriptor* field, lua_State* L, int index);
 bool encode_repeated(Message* message, const FieldDescriptor* field, lua_State* L, int index);
 bool encode_table(Message* message, const FieldDescriptor* field, lua_State* L, int index);
+bool encode_array(Message* message, const FieldDescriptor* field, const ProtoArray* array);
 bool encode_single(Message* message, const FieldDescriptor* field, lua_State* L, int index);
 bool encode_multiple(Message* message, const FieldDescriptor* field, lua_State* L, int index);
 bool encode_message(Message* message, const Descriptor* descriptor, lua_State* L, int index);
 
+static thread_local bool g_arenaBusy = false;
+
+static Arena* retained_arena()
+{
+    static thread_local std::unique_ptr<char[]> block(new char[PROTO_ARENA_BLOCK]);
+    static thread_local Arena arena(block.get(), PROTO_ARENA_BLOCK);
+    return &arena;
+}
+
+Arena* MessageArena::get()
+{
+    if (arena_)
+        return arena_;
+
+    retained_ = !g_arenaBusy;
+    if (retained_)
+    {
+        g_arenaBusy = true;
+        arena_ = retained_arena();
+    }
+    else
+    {
+        arena_ = new Arena();
+    }
+    return arena_;
+}
+
+MessageArena::~MessageArena()
+{
+    if (!arena_)
+        return;
+
+    if (!retained_)
+    {
+        delete arena_;
+        return;
+    }
+
+    g_stats.arena_calls++;
+    if (arena_->SpaceAllocated() > PROTO_ARENA_BLOCK)
+        g_stats.arena_overflow++;
+    arena_->Reset();
+    g_arenaBusy = false;
+}
+
+ReflectMessage::ReflectMessage(const ProtoPlan* plan, const Message* prototype)
+    : plan_(plan), message_(NULL), pooled_(g_options.pool > 0)
+{
+    if (!pooled_)
+    {
+        message_ = prototype->New(arena_.get());
+    }
+    else if (!plan->pool.empty())
+    {
+        g_stats.pool_hit++;
+        message_ = plan->pool.back();
+        plan->pool.pop_back();
+    }
+    else
+    {
+        g_stats.pool_miss++;
+        message_ = prototype->New();
+    }
+}
+
+ReflectMessage::~ReflectMessage()
+{
+    if (!pooled_)
+        return;
+
+    if ((int)plan_->pool.size() < g_options.pool)
+    {
+        message_->Clear();
+        plan_->pool.push_back(message_);
+    }
+    else
+    {
+        delete message_;
+    }
+}
+
 bool encode_field(Message* message, const FieldDescriptor* field, lua_State* L, int index)
 {
     if (field->is_map())
@@ -51,6 +134,11 @@ bool encode_repeated(Message* message, const FieldDescriptor* field, lua_State*
         return true;
     }
 
+    const ProtoArray* array = array_test(L, index);
+    if (array) {
+        return encode_array(message, field, array);
+    }
+
     if (!lua_istable(L, index)) {
         proto_error("encode_repeated field isn't a table, field=%s", field->full_name().c_str());
         return false;
@@ -66,6 +154,40 @@ bool encode_repeated(Message* message, const FieldDescriptor* field, lua_State*
     return true;
 }
 
+bool encode_array(Message* message, const FieldDescriptor* field, const ProtoArray* array)
+{
+    const Reflection* reflection = message->GetReflection();
+    size_t count = array->size();
+    for (size_t i = 0; i < count; i++)
+    {
+        switch (field->cpp_type())
+        {
+        case FieldDescriptor::CPPTYPE_DOUBLE:
+            reflection->AddDouble(message, field, array->get_number(i));
+            break;
+        case FieldDescriptor::CPPTYPE_FLOAT:
+            reflection->AddFloat(message, field, (float)array->get_number(i));
+            break;
+        case FieldDescriptor::CPPTYPE_INT32:
+            reflection->AddInt32(message, field, (int32)array->get_integer(i));
+            break;
+        case FieldDescriptor::CPPTYPE_UINT32:
+            reflection->AddUInt32(message, field, (uint32)array->get_integer(i));
+            break;
+        case FieldDescriptor::CPPTYPE_INT64:
+            reflection->AddInt64(message, field, (int64)array->get_integer(i));
+            break;
+        case FieldDescriptor::CPPTYPE_UINT64:
+            reflection->AddUInt64(message, field, (uint64)array->get_integer(i));
+            break;
+        default:
+            proto_error("encode_array field isn't numeric, field=%s", field->full_name().c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
 bool encode_table(Message* message, const FieldDescriptor* field, lua_State* L, int index)
 {
     if (lua_isnil(L, index)) {
@@ -199,71 +321,235 @@ bool encode_message(Message* message, const Descriptor* descriptor, lua_State* L
         return false;
     }
 
-    for (int i = 0; i < descriptor->field_count(); i++)
+    const ProtoPlan* plan = proto_plan(descriptor);
+    PROTO_ASSERT(plan);
+
+    if (!lua_checkstack(L, 8)) {
+        proto_error("encode_message stack overflow, field=%s", descriptor->full_name().c_str());
+        return false;
+    }
+
+    index = lua_absindex(L, index);
+    proto_push_names(plan, L);
+    int names = lua_gettop(L);
+
+    const FieldPlan* present[PLAN_SPARSE_MAX];
+    int count = proto_present(plan, L, index, names, present);
+    PROTO_ASSERT(count != PLAN_UNKNOWN);
+
+    const FieldPlan** fields = count == PLAN_DENSE ? plan->sorted : present;
+    if (count == PLAN_DENSE)
+        count = plan->field_count;
+
+    for (int i = 0; i < count; i++)
     {
-        const FieldDescriptor* field = descriptor->field(i);
-        lua_getfield(L, index, field->name().c_str());
-        PROTO_DO(encode_field(message, field, L, lua_absindex(L, -1)));
+        const FieldDescriptor* field = fields[i]->field;
+        plan_pushname(L, names, fields[i]);
+        if (g_options.raw)
+            lua_rawget(L, index);
+        else
+            lua_gettable(L, index);
+        PROTO_DO(encode_field(message, field, L, names + 1));
         lua_pop(L, 1);
     }
+    lua_pop(L, 1);
     return true;
 }
 
-bool proto_encode(const char* proto, lua_State* L, int index, char* output, size_t* size)
+int reflect_call(lua_State* L, lua_CFunction func, ReflectCall* call, int start)
 {
-    const Descriptor* descriptor = g_importer->pool()->FindMessageTypeByName(proto);
-    PROTO_ASSERT(descriptor);
+    if (!lua_checkstack(L, call->count + 2))
+        return 0;
 
-    const Message* prototype = g_factory->GetPrototype(descriptor);
-    PROTO_ASSERT(prototype);
+    lua_pushcfunction(L, func);
+    lua_pushlightuserdata(L, call);
+    for (int i = 0; i < call->count; i++)
+        lua_pushvalue(L, start + i);
+    return lua_pcall(L, call->count + 1, LUA_MULTRET, 0);
+}
 
-    index = lua_absindex(L, index);
-    std::unique_ptr<Message> message(prototype->New());
-    PROTO_DO(encode_message(message.get(), descriptor, L, index));
+// fill call->message from the values after the call
+static int encode_call(lua_State* L)
+{
+    ReflectCall* call = (ReflectCall*)lua_touserdata(L, 1);
+    if (!call->pack)
+    {
+        call->result = encode_message(call->message, call->plan->descriptor, L, 2);
+        return 0;
+    }
+
+    call->result = true;
+    for (int i = 0; i < call->count && call->result; i++)
+    {
+        call->result = encode_field(call->message, call->plan->sorted[i]->field, L, 2 + i);
+    }
+    return 0;
+}
+
+// a message missing a required field isn't written, decode would reject it
+// and the direct writer fails on it too. libprotobuf only checks in debug
+bool check_required(const Message* message)
+{
+    if (!message->IsInitialized()) {
+        proto_error("check_required missing required fields, proto=%s, fields=%s",
+            message->GetDescriptor()->full_name().c_str(), message->InitializationErrorString().c_str());
+        return false;
+    }
+    return true;
+}
+
+// serialize straight into lua owned memory, sized up front
+bool push_message(Message* message, lua_State* L)
+{
+    PROTO_DO(check_required(message));
+    size_t size = message->ByteSizeLong();
+    PROTO_ASSERT(size <= INT_MAX);
+#if LUA_VERSION_NUM == 501
+    ScratchBuffer scratch;
+    ProtoBuffer& buffer = scratch.buffer();
+    PROTO_DO(buffer.reserve(size));
+    message->SerializeWithCachedSizesToArray((uint8*)buffer.tail());
+    lua_pushlstring(L, buffer.data(), size);
+#else
+    luaL_Buffer b;
+    char* output = luaL_buffinitsize(L, &b, size);
+    message->SerializeWithCachedSizesToArray((uint8*)output);
+    luaL_pushresultsize(&b, size);
+#endif
+    return true;
+}
+
+// serialize to the end of buffer
+bool append_message(Message* message, ProtoBuffer& buffer)
+{
+    PROTO_DO(check_required(message));
+    size_t size = message->ByteSizeLong();
+    PROTO_DO(buffer.reserve(size));
+    message->SerializeWithCachedSizesToArray((uint8*)buffer.tail());
+    buffer.advance(size);
+    return true;
+}
 
+// into output, or pushed to the lua stack without one
+bool output_message(Message* message, lua_State* L, char* output, size_t* size)
+{
     if (output && size) // export to buffer
     {
+        PROTO_DO(check_required(message));
         PROTO_DO(message->SerializeToArray(output, *size));
         *size = message->ByteSizeLong();
     }
-    else 
+    else // push to lua stack
     {
-        string output; // push to lua stack
-        PROTO_DO(message->SerializeToString(&output));
-        lua_pushlstring(L, output.c_str(), output.size());
+        PROTO_DO(push_message(message, L));
     }
     return true;
 }
 
-std::vector<const FieldDescriptor*> SortFieldsByNumber(const Descriptor* descriptor);
-bool proto_pack(const char* proto, lua_State* L, int start, int end, char* output, size_t* size)
+bool write_proto(const ProtoPlan* plan, lua_State* L, int index, ProtoBuffer& buffer);
+bool proto_encode(const ProtoType* type, lua_State* L, int index, ProtoBuffer& buffer)
 {
-    const Descriptor* descriptor = g_importer->pool()->FindMessageTypeByName(proto);
-    PROTO_ASSERT(descriptor);
+    index = lua_absindex(L, index);
+    if (!g_options.reflection)
+        return write_proto(type->plan, L, index, buffer);
 
-    const Message* prototype = g_factory->GetPrototype(descriptor);
+    const Message* prototype = type->prototype ? type->prototype : g_factory->GetPrototype(type->descriptor);
     PROTO_ASSERT(prototype);
 
-    start = lua_absindex(L, start);
-    end = lua_absindex(L, end);
-    std::unique_ptr<Message> message(prototype->New());
-    std::vector<const FieldDescriptor*> fields = SortFieldsByNumber(descriptor);
-    for (int i = 0; i < (int)fields.size() && start + i <= end; i++)
+    int status = 0;
+    bool result = false;
     {
-        const FieldDescriptor* field = fields[i];
-        PROTO_DO(encode_field(message.get(), field, L, start + i));
+        ReflectMessage holder(type->plan, prototype);
+        ReflectCall call = { type->plan, holder.get(), 1, false, false };
+        status = reflect_call(L, encode_call, &call, index);
+        result = status == 0 && call.result && append_message(holder.get(), buffer);
     }
+    if (status != 0)
+        lua_error(L);
+    return result;
+}
 
-    if (output && size) // export to buffer
+bool write_proto(const ProtoPlan* plan, lua_State* L, int index, char* output, size_t* size);
+bool proto_encode(const ProtoType* type, lua_State* L, int index, char* output, size_t* size)
+{
+    index = lua_absindex(L, index);
+    if (!g_options.reflection)
+        return write_proto(type->plan, L, index, output, size);
+
+    const Message* prototype = type->prototype ? type->prototype : g_factory->GetPrototype(type->descriptor);
+    PROTO_ASSERT(prototype);
+
+    int status = 0;
+    bool result = false;
     {
-        PROTO_DO(message->SerializeToArray(output, *size));
-        *size = message->ByteSizeLong();
+        ReflectMessage holder(type->plan, prototype);
+        ReflectCall call = { type->plan, holder.get(), 1, false, false };
+        status = reflect_call(L, encode_call, &call, index);
+        result = status == 0 && call.result && output_message(holder.get(), L, output, size);
     }
-    else 
+    if (status != 0)
+        lua_error(L);
+    return result;
+}
+
+bool proto_encode(const char* proto, lua_State* L, int index, char* output, size_t* size)
+{
+    ProtoType type;
+    PROTO_DO(proto_resolve(proto, &type));
+    return proto_encode(&type, L, index, output, size);
+}
+
+bool write_pack(const ProtoPlan* plan, lua_State* L, int start, int end, ProtoBuffer& buffer);
+bool proto_pack(const ProtoType* type, lua_State* L, int start, int end, ProtoBuffer& buffer)
+{
+    start = lua_absindex(L, start);
+    end = lua_absindex(L, end);
+    if (!g_options.reflection)
+        return write_pack(type->plan, L, start, end, buffer);
+
+    const Message* prototype = type->prototype ? type->prototype : g_factory->GetPrototype(type->descriptor);
+    PROTO_ASSERT(prototype);
+
+    int status = 0;
+    bool result = false;
     {
-        string output; // push to lua stack
-        PROTO_DO(message->SerializeToString(&output));
-        lua_pushlstring(L, output.c_str(), output.size());
+        ReflectMessage holder(type->plan, prototype);
+        ReflectCall call = { type->plan, holder.get(), std::min(type->plan->field_count, end - start + 1), true, false };
+        status = reflect_call(L, encode_call, &call, start);
+        result = status == 0 && call.result && append_message(holder.get(), buffer);
     }
-    return true;
-}
\ No newline at end of file
+    if (status != 0)
+        lua_error(L);
+    return result;
+}
+
+bool write_pack(const ProtoPlan* plan, lua_State* L, int start, int end, char* output, size_t* size);
+bool proto_pack(const ProtoType* type, lua_State* L, int start, int end, char* output, size_t* size)
+{
+    start = lua_absindex(L, start);
+    end = lua_absindex(L, end);
+    if (!g_options.reflection)
+        return write_pack(type->plan, L, start, end, output, size);
+
+    const Message* prototype = type->prototype ? type->prototype : g_factory->GetPrototype(type->descriptor);
+    PROTO_ASSERT(prototype);
+
+    int status = 0;
+    bool result = false;
+    {
+        ReflectMessage holder(type->plan, prototype);
+        ReflectCall call = { type->plan, holder.get(), std::min(type->plan->field_count, end - start + 1), true, false };
+        status = reflect_call(L, encode_call, &call, start);
+        result = status == 0 && call.result && output_message(holder.get(), L, output, size);
+    }
+    if (status != 0)
+        lua_error(L);
+    return result;
+}
+
+bool proto_pack(const char* proto, lua_State* L, int start, int end, char* output, size_t* size)
+{
+    ProtoType type;
+    PROTO_DO(proto_resolve(proto, &type));
+    return proto_pack(&type, L, start, end, output, size);
+}
@@ -0,0 +1,359 @@
+#ifndef _JINJIAZHANG_PROTOIMPORTER_H_
+#define _JINJIAZHANG_PROTOIMPORTER_H_
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <vector>
+#include "google/protobuf/descriptor.pb.h"
+#include "google/protobuf/descriptor_database.h"
+#include "google/protobuf/compiler/importer.h"
+#include "google/protobuf/compiler/parser.h"
+
+// an error of the tokenizer or parser, reported on the calling thread
+struct ParseError
+{
+    int line;
+    int column;
+    std::string message;
+};
+
+// a source file parsed on a worker thread
+struct ParsedFile
+{
+    std::string name;
+    google::protobuf::FileDescriptorProto file;
+    google::protobuf::compiler::SourceLocationTable locations;
+    std::vector<ParseError> errors;
+    const google::protobuf::Message* output;   // the pool's proto once handed over
+    bool failed;
+    bool broken;        // failed, or one of its imports did
+    double seconds;
+};
+
+// parsed files in front of the other databases. a file is swapped into the
+// proto the pool builds from, which keeps the addresses of its elements so
+// the locations recorded by the parser still find them
+class ParsedDatabase : public google::protobuf::DescriptorDatabase
+{
+public:
+    ParsedDatabase(google::protobuf::DescriptorDatabase* fallback) : fallback_(fallback), frozen_(false) {}
+    ~ParsedDatabase()
+    {
+        std::map<std::string, ParsedFile*>::iterator it = files_.begin();
+        for (; it != files_.end(); ++it)
+            delete it->second;
+    }
+
+    bool Has(const std::string& filename) const { return files_.count(filename) != 0; }
+
+    // finds nothing, lookups through a pool stacked on this one's must not
+    // build files down here
+    void Freeze(bool frozen) { frozen_ = frozen; }
+
+    // takes the file, a failed one is not looked for anywhere else
+    void Add(ParsedFile* parsed)
+    {
+        std::map<std::string, ParsedFile*>::iterator it = files_.find(parsed->name);
+        if (it != files_.end())
+            delete it->second;
+        files_[parsed->name] = parsed;
+    }
+
+    // once its file is built
+    void Remove(const std::string& filename)
+    {
+        std::map<std::string, ParsedFile*>::iterator it = files_.find(filename);
+        if (it == files_.end())
+            return;
+        delete it->second;
+        files_.erase(it);
+    }
+
+    const ParsedFile* Find(const std::string& filename) const
+    {
+        std::map<std::string, ParsedFile*>::const_iterator it = files_.find(filename);
+        return it == files_.end() ? NULL : it->second;
+    }
+
+    bool FindFileByName(const std::string& filename, google::protobuf::FileDescriptorProto* output)
+    {
+        if (frozen_)
+            return false;
+        std::map<std::string, ParsedFile*>::iterator it = files_.find(filename);
+        if (it == files_.end())
+            return fallback_->FindFileByName(filename, output);
+
+        ParsedFile* parsed = it->second;
+        if (parsed->failed || parsed->output)
+            return false;
+        output->Swap(&parsed->file);
+        parsed->output = output;
+        return true;
+    }
+
+    bool FindFileContainingSymbol(const std::string& symbol_name, google::protobuf::FileDescriptorProto* output)
+    {
+        return !frozen_ && fallback_->FindFileContainingSymbol(symbol_name, output);
+    }
+
+    bool FindFileContainingExtension(const std::string& containing_type, int field_number, google::protobuf::FileDescriptorProto* output)
+    {
+        return !frozen_ && fallback_->FindFileContainingExtension(containing_type, field_number, output);
+    }
+
+private:
+    google::protobuf::DescriptorDatabase* fallback_;
+    std::map<std::string, ParsedFile*> files_;
+    bool frozen_;
+};
+
+// build errors of parsed files at the lines the parser recorded, the
+// others go to the source tree's collector
+class ParsedErrorCollector : public google::protobuf::DescriptorPool::ErrorCollector
+{
+public:
+    ParsedErrorCollector(const ParsedDatabase* parsed, google::protobuf::DescriptorPool::ErrorCollector* fallback, google::protobuf::compiler::MultiFileErrorCollector* collector)
+        : parsed_(parsed), fallback_(fallback), collector_(collector) {}
+
+    void AddError(const std::string& filename, const std::string& element_name, const google::protobuf::Message* descriptor, ErrorLocation location, const std::string& message)
+    {
+        int line = -1;
+        int column = 0;
+        if (!Locate(filename, element_name, descriptor, location, &line, &column))
+        {
+            fallback_->AddError(filename, element_name, descriptor, location, message);
+            return;
+        }
+        collector_->AddError(filename, line, column, message);
+    }
+
+    void AddWarning(const std::string& filename, const std::string& element_name, const google::protobuf::Message* descriptor, ErrorLocation location, const std::string& message)
+    {
+        int line = -1;
+        int column = 0;
+        if (!Locate(filename, element_name, descriptor, location, &line, &column))
+        {
+            fallback_->AddWarning(filename, element_name, descriptor, location, message);
+            return;
+        }
+        collector_->AddWarning(filename, line, column, message);
+    }
+
+private:
+    bool Locate(const std::string& filename, const std::string& element_name, const google::protobuf::Message* descriptor, ErrorLocation location, int* line, int* column)
+    {
+        const ParsedFile* parsed = parsed_->Find(filename);
+        if (parsed == NULL)
+            return false;
+
+        // only the file itself moved in the swap
+        if (descriptor == parsed->output)
+            descriptor = &parsed->file;
+        if (location == IMPORT)
+            parsed->locations.FindImport(descriptor, element_name, line, column);
+        else
+            parsed->locations.Find(descriptor, location, line, column);
+        return true;
+    }
+
+private:
+    const ParsedDatabase* parsed_;
+    google::protobuf::DescriptorPool::ErrorCollector* fallback_;
+    google::protobuf::compiler::MultiFileErrorCollector* collector_;
+};
+
+// the mapped paths, but a file opened while a parse_all root is set is looked
+// for under the root first. a file found there stays bound to it, so a reload
+// reads it from the same place
+class ProtoSourceTree : public google::protobuf::compiler::SourceTree
+{
+public:
+    ProtoSourceTree() : root_(NULL), last_(&paths_) {}
+    ~ProtoSourceTree()
+    {
+        std::map<std::string, google::protobuf::compiler::DiskSourceTree*>::iterator it = roots_.begin();
+        for (; it != roots_.end(); ++it)
+            delete it->second;
+    }
+
+    void MapPath(const std::string& virtual_path, const std::string& disk_path) { paths_.MapPath(virtual_path, disk_path); }
+
+    // an empty path clears the root
+    void SetRoot(const std::string& disk_path)
+    {
+        root_ = NULL;
+        if (disk_path.empty())
+            return;
+
+        google::protobuf::compiler::DiskSourceTree*& root = roots_[disk_path];
+        if (root == NULL)
+        {
+            root = new google::protobuf::compiler::DiskSourceTree();
+            root->MapPath("", disk_path);
+        }
+        root_ = root;
+    }
+
+    bool VirtualFileToDiskFile(const std::string& virtual_file, std::string* disk_file)
+    {
+        return Find(virtual_file)->VirtualFileToDiskFile(virtual_file, disk_file);
+    }
+
+    google::protobuf::io::ZeroCopyInputStream* Open(const std::string& filename)
+    {
+        std::string disk_file;
+        if (root_ && bound_.count(filename) == 0 && root_->VirtualFileToDiskFile(filename, &disk_file))
+            bound_[filename] = root_;
+        last_ = Find(filename);
+        return last_->Open(filename);
+    }
+
+    std::string GetLastErrorMessage() { return last_->GetLastErrorMessage(); }
+
+private:
+    google::protobuf::compiler::DiskSourceTree* Find(const std::string& filename)
+    {
+        std::map<std::string, google::protobuf::compiler::DiskSourceTree*>::iterator it = bound_.find(filename);
+        return it == bound_.end() ? &paths_ : it->second;
+    }
+
+private:
+    google::protobuf::compiler::DiskSourceTree paths_;
+    std::map<std::string, google::protobuf::compiler::DiskSourceTree*> roots_;     // by disk path
+    std::map<std::string, google::protobuf::compiler::DiskSourceTree*> bound_;     // by virtual file
+    google::protobuf::compiler::DiskSourceTree* root_;
+    google::protobuf::compiler::DiskSourceTree* last_;
+};
+
+// an Importer whose pool finds the files parsed ahead by compile_sources,
+// then the files of loaded descriptor sets, then the source tree. set
+// files are kept encoded until the pool builds them.
+//
+// an incremental reload stacks a new one on the current importer, its pool
+// has the other's as underlay and builds the stale files again, which hide
+// their old versions. an underlay leaves no room for a database so files
+// are built one by one on import
+class ProtoImporter
+{
+public:
+    ProtoImporter(google::protobuf::compiler::SourceTree* source_tree, google::protobuf::compiler::MultiFileErrorCollector* error_collector)
+        : base_(NULL), source_(source_tree), merged_(&sets_, &source_), parsed_(&merged_),
+          errors_(&parsed_, source_.GetValidationErrorCollector(), error_collector),
+          pool_(new google::protobuf::DescriptorPool(&parsed_, &errors_))
+    {
+        source_.RecordErrorsTo(error_collector);
+        pool_->EnforceWeakDependencies(true);
+    }
+
+    ProtoImporter(ProtoImporter* base, const std::set<std::string>& stale, google::protobuf::compiler::SourceTree* source_tree, google::protobuf::compiler::MultiFileErrorCollector* error_collector)
+        : base_(base), stale_(stale), source_(source_tree), merged_(&sets_, &source_), parsed_(&merged_),
+          errors_(&parsed_, source_.GetValidationErrorCollector(), error_collector),
+          pool_(new google::protobuf::DescriptorPool(base->pool()))
+    {
+        source_.RecordErrorsTo(error_collector);
+        pool_->EnforceWeakDependencies(true);
+        base_->parsed_.Freeze(true);
+    }
+
+    ~ProtoImporter()
+    {
+        if (base_)
+            base_->parsed_.Freeze(false);
+    }
+
+    const google::protobuf::FileDescriptor* Import(const std::string& filename)
+    {
+        const google::protobuf::FileDescriptor* file = base_ ? Build(filename) : pool_->FindFileByName(filename);
+        if (file)
+            Built(file);
+        return file;
+    }
+
+    const google::protobuf::DescriptorPool* pool() const { return pool_.get(); }
+
+    // stacked on another importer, its types are built when they are imported
+    bool Stacked() const { return base_ != NULL; }
+
+    // a file of the source tree parsed without building it
+    bool Parse(const std::string& filename, google::protobuf::FileDescriptorProto* file) { return source_.FindFileByName(filename, file); }
+
+    // known to the pool or one of its databases, it won't be parsed again
+    bool HasFile(const std::string& filename) const
+    {
+        if (names_.count(filename) != 0 || built_.count(filename) != 0 || parsed_.Has(filename))
+            return true;
+        return base_ && stale_.count(filename) == 0 && base_->HasFile(filename);
+    }
+
+    // a file added before is kept
+    bool AddFile(const google::protobuf::FileDescriptorProto& file)
+    {
+        if (!names_.insert(file.name()).second)
+            return true;
+        std::string data;
+        file.SerializeToString(&data);
+        return sets_.AddCopy(data.data(), (int)data.size());
+    }
+
+    void AddParsed(ParsedFile* parsed) { parsed_.Add(parsed); }
+
+private:
+    void Built(const google::protobuf::FileDescriptor* file)
+    {
+        if (!built_.insert(file->name()).second)
+            return;
+        parsed_.Remove(file->name());
+        for (int i = 0; i < file->dependency_count(); i++)
+            Built(file->dependency(i));
+    }
+
+    // the file and the imports this pool has no current version of, imports
+    // first. a stale file of the base doesn't count until it is built here
+    const google::protobuf::FileDescriptor* Build(const std::string& filename)
+    {
+        const google::protobuf::FileDescriptor* file = pool_->FindFileByName(filename);
+        if (file && (file->pool() == pool_.get() || stale_.count(filename) == 0))
+            return file;
+        if (!building_.insert(filename).second)
+            return NULL;
+
+        google::protobuf::FileDescriptorProto proto;
+        if (parsed_.FindFileByName(filename, &proto))
+        {
+            for (int i = 0; i < proto.dependency_size(); i++)
+                Build(proto.dependency(i));
+            file = pool_->BuildFileCollectingErrors(proto, &errors_);
+        }
+        else
+        {
+            file = NULL;
+        }
+        building_.erase(filename);
+        return file;
+    }
+
+private:
+    ProtoImporter* base_;           // owned by the caller, it outlives this one
+    std::set<std::string> stale_;   // files of base built again here
+    std::set<std::string> building_;
+    std::set<std::string> names_;
+    std::set<std::string> built_;
+    google::protobuf::compiler::SourceTreeDescriptorDatabase source_;
+    google::protobuf::EncodedDescriptorDatabase sets_;
+    google::protobuf::MergedDescriptorDatabase merged_;
+    ParsedDatabase parsed_;
+    ParsedErrorCollector errors_;
+    std::unique_ptr<google::protobuf::DescriptorPool> pool_;
+};
+
+// the files and the imports the importer doesn't have yet, parsed by up to
+// threads workers. they come back imports first, with the errors of the
+// tokenizer and parser already reported to collector. locate records the
+// source locations the build errors of the files are reported at
+void compile_sources(ProtoImporter* importer, google::protobuf::compiler::SourceTree* source_tree,
+    google::protobuf::compiler::MultiFileErrorCollector* collector,
+    const std::vector<std::string>& files, int threads, bool locate, std::vector<ParsedFile*>* sorted);
+
+#endif
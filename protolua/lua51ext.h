@@ -33,6 +33,11 @@ inline int lua_absindex(lua_State *L, int idx)
     return idx;
 }
 
+inline void lua_pushglobaltable(lua_State *L)
+{
+    lua_pushvalue(L, LUA_GLOBALSINDEX);
+}
+
 inline lua_Integer luaL_len(lua_State *L, int idx)
 {
     return luaL_getn(L, idx);
@@ -50,6 +55,24 @@ inline void luaL_setfuncs(lua_State *L, const luaL_Reg *l, int nup) {
     lua_pop(L, nup);  /* remove upvalues */
 }
 
+inline void luaL_setmetatable(lua_State *L, const char *tname)
+{
+    luaL_getmetatable(L, tname);
+    lua_setmetatable(L, -2);
+}
+
+inline void* luaL_testudata(lua_State *L, int idx, const char *tname)
+{
+    void* p = lua_touserdata(L, idx);
+    if (p == NULL || !lua_getmetatable(L, idx))
+        return NULL;
+    luaL_getmetatable(L, tname);
+    if (!lua_rawequal(L, -1, -2))
+        p = NULL;
+    lua_pop(L, 2);
+    return p;
+}
+
 inline long long lua_toint64(lua_State *L, int idx)
 {
     if (lua_type(L, idx) == LUA_TSTRING)
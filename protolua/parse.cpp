@@ -1,16 +1,157 @@
 #include "protolua.h"
+#include "importer.h"
 #include <list>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+#include "google/protobuf/descriptor.pb.h"
+#include "google/protobuf/descriptor_database.h"
 
 using namespace google::protobuf;
 using namespace google::protobuf::compiler;
 
-class ProtoErrorCollector;
+#define PROTO_GENERATIONS 8     // incremental reloads stacked before a full one compacts them
+
+// a file as it was when it was loaded, proto.reload looks for changes
+struct SourceStamp
+{
+    std::string path;       // on disk, empty when not read from one
+    time_t mtime;
+    long long size;
+    unsigned long long hash;    // of the content
+};
+
+// a descriptor set read again from its path on reload, or kept in memory
+struct LoadedSet
+{
+    std::string path;
+    std::string data;
+    bool lazy;
+    SourceStamp stamp;
+};
+
+// short names of the enums of lazy files to their full names, an enum
+// leaves when its global is defined
+typedef std::map<std::string, std::string> EnumIndex;
+
+class ProtoErrorCollector : public MultiFileErrorCollector
+{
+    virtual void AddError(const std::string& filename, int line, int column, const std::string& message)
+    {
+        proto_error("[file]%s line %d, column %d : %s", filename.c_str(), line, column, message.c_str());
+    }
+
+    virtual void AddWarning(const std::string& filename, int line, int column, const std::string& message)
+    {
+        proto_warn("[file]%s line %d, column %d : %s", filename.c_str(), line, column, message.c_str());
+    }
+};
+
 std::set<std::string> g_parsedFiles;
+std::set<std::string> g_lazyFiles;
 std::set<std::string> g_definedEnums;
-DiskSourceTree* g_sourceTree = 0;
+std::set<const FileDescriptor*> g_traversedFiles;
+std::vector<LoadedSet> g_loadedSets;
+std::set<std::string> g_setFiles;
+std::map<std::string, SourceStamp> g_stamps;
+EnumIndex g_lazyEnums;
+ProtoSourceTree* g_sourceTree = 0;
 ProtoErrorCollector* g_errorCollector = 0;
-Importer* g_importer = 0;
+ProtoImporter* g_importer = 0;
+std::vector<ProtoImporter*> g_generations;     // the first one, then those stacked by reloads
 DynamicMessageFactory* g_factory = 0;
+int g_epoch = 0;
+
+bool read_file(const char* path, std::string* data)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        proto_error("read_file open fail, path=%s", path);
+        return false;
+    }
+
+    char block[8192];
+    size_t size = 0;
+    while ((size = fread(block, 1, sizeof(block), file)) > 0)
+    {
+        data->append(block, size);
+    }
+
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    if (failed)
+    {
+        proto_error("read_file read fail, path=%s", path);
+        return false;
+    }
+    return true;
+}
+
+// fnv-1a
+unsigned long long hash_bytes(const std::string& data)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < data.size(); i++)
+    {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+bool read_stamp(const std::string& path, SourceStamp* stamp)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+
+    std::string data;
+    PROTO_DO(read_file(path.c_str(), &data));
+    stamp->path = path;
+    stamp->mtime = info.st_mtime;
+    stamp->size = (long long)info.st_size;
+    stamp->hash = hash_bytes(data);
+    return true;
+}
+
+// the content is only hashed again when the mtime or size moved. a stamp
+// whose content didn't change takes the new mtime
+bool stamp_changed(SourceStamp* stamp)
+{
+    struct stat info;
+    if (stat(stamp->path.c_str(), &info) != 0)
+        return true;
+    if (info.st_mtime == stamp->mtime && (long long)info.st_size == stamp->size)
+        return false;
+
+    SourceStamp now;
+    if (!read_stamp(stamp->path, &now) || now.hash != stamp->hash)
+        return true;
+    *stamp = now;
+    return false;
+}
+
+// a file built from the source tree is stamped the first time it is walked,
+// files of descriptor sets go with their set
+void watch_file(const FileDescriptor* file_desc)
+{
+    const std::string& name = file_desc->name();
+    if (g_stamps.count(name) != 0 || g_setFiles.count(name) != 0)
+        return;
+
+    std::string path;
+    SourceStamp stamp;
+    if (g_sourceTree->VirtualFileToDiskFile(name, &path) && read_stamp(path, &stamp))
+        g_stamps[name] = stamp;
+}
 
 bool define_enum(const EnumDescriptor* enum_desc, lua_State* L)
 {
@@ -54,8 +195,13 @@ bool traverse_message(const Descriptor* message_desc, lua_State* L)
     return true;
 }
 
+// a file shared by many importers is only walked the first time
 bool traverse_file(const FileDescriptor* file_desc, lua_State* L)
 {
+    if (!g_traversedFiles.insert(file_desc).second)
+        return true;
+    watch_file(file_desc);
+
     int dep_count = file_desc->dependency_count();
     for (int i = 0; i < dep_count; i++)
     {
@@ -79,8 +225,177 @@ bool traverse_file(const FileDescriptor* file_desc, lua_State* L)
     return true;
 }
 
+void index_message(const DescriptorProto& message, const std::string& scope, EnumIndex* enums)
+{
+    int enum_count = message.enum_type_size();
+    for (int i = 0; i < enum_count; i++)
+    {
+        enums->insert(std::make_pair(message.enum_type(i).name(), scope + message.enum_type(i).name()));
+    }
+
+    int nest_count = message.nested_type_size();
+    for (int i = 0; i < nest_count; i++)
+    {
+        index_message(message.nested_type(i), scope + message.nested_type(i).name() + ".", enums);
+    }
+}
+
+// the enums of a file, like traverse_file defines them but without building it
+void index_file(const FileDescriptorProto& file, EnumIndex* enums)
+{
+    std::string scope = file.package().empty() ? "" : file.package() + ".";
+    int enum_count = file.enum_type_size();
+    for (int i = 0; i < enum_count; i++)
+    {
+        enums->insert(std::make_pair(file.enum_type(i).name(), scope + file.enum_type(i).name()));
+    }
+
+    int message_count = file.message_type_size();
+    for (int i = 0; i < message_count; i++)
+    {
+        index_message(file.message_type(i), scope + file.message_type(i).name() + ".", enums);
+    }
+}
+
+// a source file and its imports go to the database, the pool builds them
+// when one of their types is looked up
+bool add_source(ProtoImporter* importer, const std::string& filename, EnumIndex* enums)
+{
+    if (importer->HasFile(filename))
+        return true;
+
+    FileDescriptorProto file;
+    PROTO_DO(importer->Parse(filename, &file));
+    PROTO_DO(importer->AddFile(file));
+    index_file(file, enums);
+
+    int dep_count = file.dependency_size();
+    for (int i = 0; i < dep_count; i++)
+    {
+        PROTO_DO(add_source(importer, file.dependency(i), enums));
+    }
+    return true;
+}
+
+// files and their imports parsed on worker threads, then the callers build
+// them one after another out of the importer's database. in lazy mode, with
+// enums, they are only added and indexed. a file that failed, or imports
+// one that did, goes to broken
+void parse_parallel(ProtoImporter* importer, const std::vector<std::string>& files, EnumIndex* enums, std::set<std::string>* broken, std::map<std::string, double>* seconds)
+{
+    std::vector<ParsedFile*> sorted;
+    compile_sources(importer, g_sourceTree, g_errorCollector, files, g_options.threads, enums == NULL, &sorted);
+    for (size_t i = 0; i < sorted.size(); i++)
+    {
+        ParsedFile* parsed = sorted[i];
+        if (parsed->broken)
+            broken->insert(parsed->name);
+        if (seconds)
+            (*seconds)[parsed->name] = parsed->seconds;
+
+        if (enums == NULL)
+        {
+            importer->AddParsed(parsed);
+            continue;
+        }
+
+        if (!parsed->failed)
+        {
+            importer->AddFile(parsed->file);
+            index_file(parsed->file, enums);
+        }
+        delete parsed;
+    }
+}
+
+bool define_lazy_enum(const char* name, lua_State* L)
+{
+    EnumIndex::iterator it = g_lazyEnums.find(name);
+    if (it == g_lazyEnums.end())
+        return false;
+
+    // out of the index first, define_enum looks the global up
+    std::string full_name = it->second;
+    g_lazyEnums.erase(it);
+    const EnumDescriptor* enum_desc = g_importer->pool()->FindEnumTypeByName(full_name);
+    if (enum_desc == NULL)
+    {
+        proto_error("define_lazy_enum build fail, enum=%s", full_name.c_str());
+        return false;
+    }
+
+    PROTO_DO(define_enum(enum_desc, L));
+    lua_getglobal(L, name);
+    return true;
+}
+
+// _G.__index once lazy files are loaded, falls back to the one before
+static int lazy_index(lua_State* L)
+{
+    if (lua_type(L, 2) == LUA_TSTRING && define_lazy_enum(lua_tostring(L, 2), L))
+        return 1;
+
+    if (lua_isfunction(L, lua_upvalueindex(1)))
+    {
+        lua_pushvalue(L, lua_upvalueindex(1));
+        lua_pushvalue(L, 1);
+        lua_pushvalue(L, 2);
+        lua_call(L, 2, 1);
+        return 1;
+    }
+
+    if (lua_istable(L, lua_upvalueindex(1)))
+    {
+        lua_pushvalue(L, 2);
+        lua_gettable(L, lua_upvalueindex(1));
+        return 1;
+    }
+
+    lua_pushnil(L);
+    return 1;
+}
+
+void lazy_globals(lua_State* L)
+{
+    lua_getfield(L, LUA_REGISTRYINDEX, "protolua.lazy");
+    bool installed = lua_toboolean(L, -1) != 0;
+    lua_pop(L, 1);
+    if (installed)
+        return;
+
+    lua_pushglobaltable(L);
+    if (!lua_getmetatable(L, -1))
+    {
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_setmetatable(L, -3);
+    }
+    lua_getfield(L, -1, "__index");
+    lua_pushcclosure(L, lazy_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pop(L, 2);
+
+    lua_pushboolean(L, 1);
+    lua_setfield(L, LUA_REGISTRYINDEX, "protolua.lazy");
+}
+
 bool proto_parse(const char* file, lua_State* L)
 {
+    // a stacked pool has no database to build lazy files from
+    bool lazy = g_options.lazy && !g_importer->Stacked();
+    std::set<std::string> broken;
+    if (g_options.threads > 1)
+        parse_parallel(g_importer, std::vector<std::string>(1, file), lazy ? &g_lazyEnums : NULL, &broken, NULL);
+
+    if (lazy)
+    {
+        PROTO_ASSERT(broken.count(file) == 0);
+        PROTO_DO(add_source(g_importer, file, &g_lazyEnums));
+        lazy_globals(L);
+        g_lazyFiles.insert(file);
+        return true;
+    }
+
     const FileDescriptor* parsed_file = g_importer->Import(file);
     if (parsed_file == NULL) {
         return false;
@@ -91,6 +406,225 @@ bool proto_parse(const char* file, lua_State* L)
     return true;
 }
 
+// pattern with * and ? against a file name
+bool match_pattern(const char* pattern, const char* name)
+{
+    if (*pattern == '\0')
+        return *name == '\0';
+    if (*pattern == '*')
+        return match_pattern(pattern + 1, name) || (*name != '\0' && match_pattern(pattern, name + 1));
+    if (*name == '\0' || (*pattern != '?' && *pattern != *name))
+        return false;
+    return match_pattern(pattern + 1, name + 1);
+}
+
+// disk paths of the files under dir and its subdirectories matching pattern
+bool list_files(const std::string& dir, const char* pattern, std::vector<std::string>* files)
+{
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE handle = FindFirstFileA((dir + "\\*").c_str(), &data);
+    if (handle == INVALID_HANDLE_VALUE)
+    {
+        proto_error("list_files open fail, dir=%s", dir.c_str());
+        return false;
+    }
+
+    do
+    {
+        std::string name = data.cFileName;
+        if (name == "." || name == "..")
+            continue;
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+            list_files(dir + "/" + name, pattern, files);
+        else if (match_pattern(pattern, name.c_str()))
+            files->push_back(dir + "/" + name);
+    } while (FindNextFileA(handle, &data));
+    FindClose(handle);
+#else
+    DIR* handle = opendir(dir.c_str());
+    if (handle == NULL)
+    {
+        proto_error("list_files open fail, dir=%s", dir.c_str());
+        return false;
+    }
+
+    struct dirent* entry = NULL;
+    while ((entry = readdir(handle)) != NULL)
+    {
+        std::string name = entry->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        std::string path = dir + "/" + name;
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            continue;
+        if (S_ISDIR(info.st_mode))
+            list_files(path, pattern, files);
+        else if (match_pattern(pattern, name.c_str()))
+            files->push_back(path);
+    }
+    closedir(handle);
+#endif
+    return true;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// every file under dir matching pattern, imported in one batch before the
+// enums are defined. a file's time includes the imports it built first
+bool proto_parse_all(const char* dir, const char* pattern, lua_State* L, ParseReport* report)
+{
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    std::vector<std::string> disk_files;
+    std::string root = dir;
+    while (root.size() > 1 && (root[root.size() - 1] == '/' || root[root.size() - 1] == '\\'))
+        root.erase(root.size() - 1);
+    PROTO_DO(list_files(root, pattern, &disk_files));
+    std::sort(disk_files.begin(), disk_files.end());
+
+    std::vector<std::string> virtual_files;
+    for (size_t i = 0; i < disk_files.size(); i++)
+    {
+        virtual_files.push_back(disk_files[i].substr(root.size() + 1));
+    }
+
+    // imports in the files are relative to dir, before the mapped paths
+    g_sourceTree->SetRoot(root + "/");
+
+    // with threads a file's time is the parse on its worker and the build
+    bool lazy = g_options.lazy && !g_importer->Stacked();
+    std::set<std::string> broken;
+    std::map<std::string, double> parse_seconds;
+    if (g_options.threads > 1)
+        parse_parallel(g_importer, virtual_files, lazy ? &g_lazyEnums : NULL, &broken, &parse_seconds);
+
+    bool result = true;
+    std::list<const FileDescriptor*> files;
+    for (size_t i = 0; i < virtual_files.size(); i++)
+    {
+        const std::string& virtual_file = virtual_files[i];
+        std::chrono::steady_clock::time_point file_start = std::chrono::steady_clock::now();
+        if (lazy)
+        {
+            if (broken.count(virtual_file) || !add_source(g_importer, virtual_file, &g_lazyEnums))
+            {
+                proto_error("proto_parse_all parse fail, file=%s", virtual_file.c_str());
+                result = false;
+                continue;
+            }
+            g_lazyFiles.insert(virtual_file);
+        }
+        else
+        {
+            const FileDescriptor* file_desc = g_importer->Import(virtual_file);
+            if (file_desc == NULL)
+            {
+                proto_error("proto_parse_all parse fail, file=%s", virtual_file.c_str());
+                result = false;
+                continue;
+            }
+            files.push_back(file_desc);
+            g_parsedFiles.insert(virtual_file);
+        }
+        report->files.push_back(std::make_pair(virtual_file, parse_seconds[virtual_file] + seconds_since(file_start)));
+    }
+    g_sourceTree->SetRoot("");
+
+    std::chrono::steady_clock::time_point traverse_start = std::chrono::steady_clock::now();
+    if (lazy)
+        lazy_globals(L);
+    std::list<const FileDescriptor*>::iterator it = files.begin();
+    for (; it != files.end(); ++it)
+    {
+        PROTO_DO(traverse_file(*it, L));
+    }
+    report->traverse = seconds_since(traverse_start);
+    report->total = seconds_since(start);
+    return result;
+}
+
+// the files of a serialized FileDescriptorSet, built in the importer's
+// pool, or only indexed when the set is lazy
+bool import_set(ProtoImporter* importer, const LoadedSet& loaded, std::list<const FileDescriptor*>* files, EnumIndex* enums)
+{
+    std::string content;
+    const std::string* data = &loaded.data;
+    if (!loaded.path.empty())
+    {
+        PROTO_DO(read_file(loaded.path.c_str(), &content));
+        data = &content;
+    }
+
+    FileDescriptorSet set;
+    if (!set.ParseFromArray(data->data(), (int)data->size()))
+    {
+        proto_error("import_set parse fail, size=%d", (int)data->size());
+        return false;
+    }
+
+    int file_count = set.file_size();
+    for (int i = 0; i < file_count; i++)
+    {
+        g_setFiles.insert(set.file(i).name());
+        if (!importer->AddFile(set.file(i)))
+        {
+            proto_error("import_set add fail, file=%s", set.file(i).name().c_str());
+            return false;
+        }
+    }
+
+    for (int i = 0; i < file_count; i++)
+    {
+        if (loaded.lazy)
+        {
+            index_file(set.file(i), enums);
+            continue;
+        }
+
+        const FileDescriptor* file_desc = importer->Import(set.file(i).name());
+        if (file_desc == NULL)
+        {
+            proto_error("import_set build fail, file=%s", set.file(i).name().c_str());
+            return false;
+        }
+        files->push_back(file_desc);
+    }
+    return true;
+}
+
+// a set from the file at path, or the size bytes at data when path is null
+bool proto_load_descriptor_set(const char* path, const char* data, size_t size, lua_State* L)
+{
+    // a stacked pool has no database to build lazy files from
+    LoadedSet loaded;
+    if (path)
+        loaded.path = path;
+    else
+        loaded.data.assign(data, size);
+    loaded.lazy = g_options.lazy && !g_importer->Stacked();
+
+    if (path)
+        read_stamp(path, &loaded.stamp);
+
+    std::list<const FileDescriptor*> files;
+    PROTO_DO(import_set(g_importer, loaded, &files, &g_lazyEnums));
+    if (loaded.lazy)
+        lazy_globals(L);
+
+    std::list<const FileDescriptor*>::iterator it = files.begin();
+    for (; it != files.end(); ++it)
+    {
+        PROTO_DO(traverse_file(*it, L));
+    }
+    g_loadedSets.push_back(loaded);
+    return true;
+}
+
 struct FieldOrderingByNumber {
     inline bool operator()(const FieldDescriptor* a,
         const FieldDescriptor* b) const {
@@ -107,38 +641,71 @@ std::vector<const FieldDescriptor*> SortFieldsByNumber(const Descriptor* descrip
     return fields;
 }
 
-class ProtoErrorCollector : public MultiFileErrorCollector
-{
-    virtual void AddError(const std::string& filename, int line, int column, const std::string& message)
-    {
-        proto_error("[file]%s line %d, column %d : %s", filename.c_str(), line, column, message.c_str());
-    }
-
-    virtual void AddWarning(const std::string& filename, int line, int column, const std::string& message)
-    {
-        proto_warn("[file]%s line %d, column %d : %s", filename.c_str(), line, column, message.c_str());
-    }
-};
-
 void proto_init(lua_State* L)
 {
     g_errorCollector = new ProtoErrorCollector();
-    g_sourceTree = new DiskSourceTree();
+    g_sourceTree = new ProtoSourceTree();
     g_sourceTree->MapPath("", "./");
     g_sourceTree->MapPath("", "./proto/");
-    g_importer = new Importer(g_sourceTree, g_errorCollector);
+    g_importer = new ProtoImporter(g_sourceTree, g_errorCollector);
+    g_generations.push_back(g_importer);
     g_factory = new DynamicMessageFactory();
 }
 
+bool proto_resolve(const char* proto, ProtoType* type)
+{
+    type->descriptor = g_importer->pool()->FindMessageTypeByName(proto);
+    PROTO_ASSERT(type->descriptor);
+
+    // a type left out of a file built again is still in the pool below
+    const FileDescriptor* file_desc = type->descriptor->file();
+    PROTO_ASSERT(g_importer->pool()->FindFileByName(file_desc->name()) == file_desc);
+
+    type->prototype = NULL;
+    type->plan = proto_plan(type->descriptor);
+    PROTO_ASSERT(type->plan);
+    type->epoch = g_epoch;
+    return true;
+}
+
 void proto_map_path(const std::string &virtual_path, const std::string &disk_path)
 {
     g_sourceTree->MapPath(virtual_path, disk_path);
 }
 
-bool proto_reload(lua_State* L)
+// every file parsed and every set read again into a new pool
+bool reload_all(lua_State* L)
 {
     std::list<const FileDescriptor*> fileDescriptorList;
-    Importer* importer = new Importer(g_sourceTree, g_errorCollector);
+    EnumIndex lazyEnums;
+    ProtoImporter* importer = new ProtoImporter(g_sourceTree, g_errorCollector);
+    std::vector<LoadedSet>::iterator set = g_loadedSets.begin();
+    for (; set != g_loadedSets.end(); ++set)
+    {
+        if (!import_set(importer, *set, &fileDescriptorList, &lazyEnums))
+        {
+            delete importer;
+            return false;
+        }
+    }
+
+    std::set<std::string> broken;
+    if (g_options.threads > 1)
+    {
+        parse_parallel(importer, std::vector<std::string>(g_lazyFiles.begin(), g_lazyFiles.end()), &lazyEnums, &broken, NULL);
+        parse_parallel(importer, std::vector<std::string>(g_parsedFiles.begin(), g_parsedFiles.end()), NULL, &broken, NULL);
+    }
+
+    std::set<std::string>::iterator lazy = g_lazyFiles.begin();
+    for (; lazy != g_lazyFiles.end(); ++lazy)
+    {
+        if (broken.count(*lazy) || !add_source(importer, *lazy, &lazyEnums))
+        {
+            delete importer;
+            return false;
+        }
+    }
+
     std::set<std::string>::iterator it = g_parsedFiles.begin();
     for (; it != g_parsedFiles.end(); ++it)
     {
@@ -151,18 +718,31 @@ bool proto_reload(lua_State* L)
         fileDescriptorList.push_back(parsed_file);
     }
 
+    proto_clear_plans();
     delete g_factory;
     g_factory = new DynamicMessageFactory();
 
-    delete g_importer;
+    for (size_t i = g_generations.size(); i > 0; i--)
+        delete g_generations[i - 1];
+    g_generations.assign(1, importer);
     g_importer = importer;
-    
+    g_stats.reload_full++;
+
     std::set<std::string>::iterator it1 = g_definedEnums.begin();
     for (; it1 != g_definedEnums.end(); ++it1)
     {
         lua_pushnil(L);
         lua_setglobal(L, it1->c_str());
     }
+    g_definedEnums.clear();
+    g_traversedFiles.clear();
+    g_stamps.clear();
+    g_lazyEnums.swap(lazyEnums);
+    for (set = g_loadedSets.begin(); set != g_loadedSets.end(); ++set)
+    {
+        if (!set->path.empty())
+            read_stamp(set->path, &set->stamp);
+    }
 
     std::list<const FileDescriptor*>::iterator it2 = fileDescriptorList.begin();
     for (; it2 != fileDescriptorList.end(); ++it2)
@@ -171,3 +751,146 @@ bool proto_reload(lua_State* L)
     }
     return true;
 }
+
+void undefine_message(const Descriptor* message_desc, lua_State* L)
+{
+    for (int i = 0; i < message_desc->enum_type_count(); i++)
+    {
+        if (g_definedEnums.erase(message_desc->enum_type(i)->name()))
+        {
+            lua_pushnil(L);
+            lua_setglobal(L, message_desc->enum_type(i)->name().c_str());
+        }
+    }
+
+    for (int i = 0; i < message_desc->nested_type_count(); i++)
+    {
+        undefine_message(message_desc->nested_type(i), L);
+    }
+}
+
+// the enum globals traverse_file defined for a file
+void undefine_file(const FileDescriptor* file_desc, lua_State* L)
+{
+    for (int i = 0; i < file_desc->enum_type_count(); i++)
+    {
+        if (g_definedEnums.erase(file_desc->enum_type(i)->name()))
+        {
+            lua_pushnil(L);
+            lua_setglobal(L, file_desc->enum_type(i)->name().c_str());
+        }
+    }
+
+    for (int i = 0; i < file_desc->message_type_count(); i++)
+    {
+        undefine_message(file_desc->message_type(i), L);
+    }
+}
+
+// the stamped files whose content changed, false when a descriptor set
+// read from a path did, which takes a full reload
+bool find_changed(std::set<std::string>* changed)
+{
+    std::vector<LoadedSet>::iterator set = g_loadedSets.begin();
+    for (; set != g_loadedSets.end(); ++set)
+    {
+        if (!set->stamp.path.empty() && stamp_changed(&set->stamp))
+            return false;
+    }
+
+    std::map<std::string, SourceStamp>::iterator it = g_stamps.begin();
+    for (; it != g_stamps.end(); ++it)
+    {
+        if (stamp_changed(&it->second))
+            changed->insert(it->first);
+    }
+    return true;
+}
+
+// the changed files and the files importing them are built again in a pool
+// stacked on the current one. the other types keep their descriptors, and
+// with them their plans, message pools and prototypes
+bool reload_changed(const std::set<std::string>& changed, lua_State* L)
+{
+    std::map<std::string, const FileDescriptor*> current;
+    std::map<std::string, std::vector<std::string> > importers;
+    std::set<const FileDescriptor*>::iterator file = g_traversedFiles.begin();
+    for (; file != g_traversedFiles.end(); ++file)
+    {
+        current[(*file)->name()] = *file;
+        for (int i = 0; i < (*file)->dependency_count(); i++)
+            importers[(*file)->dependency(i)->name()].push_back((*file)->name());
+    }
+
+    std::set<std::string> stale;
+    std::vector<std::string> pending(changed.begin(), changed.end());
+    while (!pending.empty())
+    {
+        std::string name = pending.back();
+        pending.pop_back();
+        if (!stale.insert(name).second)
+            continue;
+        std::vector<std::string>& users = importers[name];
+        pending.insert(pending.end(), users.begin(), users.end());
+    }
+
+    std::vector<std::string> files(stale.begin(), stale.end());
+    ProtoImporter* importer = new ProtoImporter(g_importer, stale, g_sourceTree, g_errorCollector);
+    std::set<std::string> broken;
+    if (g_options.threads > 1)
+        parse_parallel(importer, files, NULL, &broken, NULL);
+
+    std::set<const FileDescriptor*> old_files;
+    std::list<const FileDescriptor*> new_files;
+    for (size_t i = 0; i < files.size(); i++)
+    {
+        const FileDescriptor* file_desc = importer->Import(files[i]);
+        if (file_desc == NULL)
+        {
+            proto_error("proto_reload build fail, file=%s", files[i].c_str());
+            delete importer;
+            return false;
+        }
+        new_files.push_back(file_desc);
+        if (current.count(files[i]) != 0)
+            old_files.insert(current[files[i]]);
+    }
+    g_stats.reload_files += files.size();
+
+    proto_release_plans(old_files);
+    g_generations.push_back(importer);
+    g_importer = importer;
+
+    std::set<const FileDescriptor*>::iterator old_file = old_files.begin();
+    for (; old_file != old_files.end(); ++old_file)
+    {
+        undefine_file(*old_file, L);
+        g_traversedFiles.erase(*old_file);
+        g_stamps.erase((*old_file)->name());
+    }
+
+    std::list<const FileDescriptor*>::iterator it = new_files.begin();
+    for (; it != new_files.end(); ++it)
+    {
+        traverse_file(*it, L);
+    }
+    return true;
+}
+
+// only the changed source files and their importers are built again, unless
+// full is set, lazy files are loaded, a descriptor set changed or there are
+// PROTO_GENERATIONS pools stacked already
+bool proto_reload(lua_State* L, bool full)
+{
+    bool stackable = !full && g_lazyFiles.empty() && g_generations.size() < PROTO_GENERATIONS;
+    std::vector<LoadedSet>::iterator set = g_loadedSets.begin();
+    for (; set != g_loadedSets.end(); ++set)
+    {
+        stackable = stackable && !set->lazy;
+    }
+
+    std::set<std::string> changed;
+    if (!stackable || !find_changed(&changed))
+        return reload_all(L);
+    return changed.empty() || reload_changed(changed, L);
+}
@@ -0,0 +1,416 @@
+#include "protolua.h"
+#include <algorithm>
+#include <unordered_map>
+#include "google/protobuf/wire_format_lite.h"
+#include "google/protobuf/message.h"
+
+using namespace google::protobuf;
+using namespace google::protobuf::internal;
+
+std::unordered_map<const Descriptor*, ProtoPlan*> g_plans;
+static char g_namesKey;         // registry key of a state's field names by plan
+static char g_defaultsKey;      // registry key of a state's sparse metatables by plan
+std::vector<ProtoPlan*> g_building;    // plans registered since the outermost proto_plan began
+
+PlanWrite write_handler(const FieldDescriptor* field);
+PlanRead read_handler(const FieldDescriptor* field);
+PlanFill fill_handler(const FieldDescriptor* field);
+std::vector<const FieldDescriptor*> SortFieldsByNumber(const Descriptor* descriptor);
+
+bool field_has_presence(const FieldDescriptor* field)
+{
+    if (field->is_repeated())
+        return false;
+    if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
+        return true;
+    if (field->containing_oneof())
+        return true;
+    return field->file()->syntax() != FileDescriptor::SYNTAX_PROTO3;
+}
+
+ArrayType field_array(const FieldDescriptor* field)
+{
+    if (!field->is_repeated() || field->is_map())
+        return ARRAY_NONE;
+
+    switch (field->type())
+    {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_SINT32:
+    case FieldDescriptor::TYPE_SFIXED32:
+        return ARRAY_INT32;
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_FIXED32:
+        return ARRAY_UINT32;
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_SINT64:
+    case FieldDescriptor::TYPE_SFIXED64:
+        return ARRAY_INT64;
+    case FieldDescriptor::TYPE_UINT64:
+    case FieldDescriptor::TYPE_FIXED64:
+        return ARRAY_UINT64;
+    case FieldDescriptor::TYPE_FLOAT:
+        return ARRAY_FLOAT;
+    case FieldDescriptor::TYPE_DOUBLE:
+        return ARRAY_DOUBLE;
+    default:
+        return ARRAY_NONE;
+    }
+}
+
+PlanLabel field_label(const FieldDescriptor* field)
+{
+    if (field->is_map())
+        return PLAN_MAP;
+    else if (field->is_required())
+        return PLAN_REQUIRED;
+    else if (field->is_repeated())
+        return PLAN_REPEATED;
+    else
+        return PLAN_OPTIONAL;
+}
+
+bool build_field(FieldPlan* plan, const FieldDescriptor* field)
+{
+    WireFormatLite::WireType wire_type = WireFormatLite::WireTypeForFieldType((WireFormatLite::FieldType)field->type());
+    plan->field = field;
+    plan->name = field->name().c_str();
+    plan->index = field->index();
+    plan->number = field->number();
+    plan->tag = WireFormatLite::MakeTag(field->number(), wire_type);
+    plan->packed_tag = WireFormatLite::MakeTag(field->number(), WireFormatLite::WIRETYPE_LENGTH_DELIMITED);
+    plan->label = field_label(field);
+    plan->packed = field->is_packed();
+    plan->packable = field->is_repeated() && FieldDescriptor::IsTypePackable(field->type());
+    plan->presence = field_has_presence(field);
+    plan->oneof = field->containing_oneof() ? field->containing_oneof()->index() : -1;
+    plan->write = write_handler(field);
+    plan->read = read_handler(field);
+    plan->fill = fill_handler(field);
+    plan->message = NULL;
+    PROTO_ASSERT(plan->write && plan->read);
+
+    if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE)
+    {
+        plan->message = proto_plan(field->message_type());
+        PROTO_ASSERT(plan->message);
+    }
+
+    plan->intkey = false;
+    plan->array = field_array(field);
+    plan->varint = field->type() == FieldDescriptor::TYPE_INT32 ? VARINT_SIGNED
+        : field->type() == FieldDescriptor::TYPE_SINT32 || field->type() == FieldDescriptor::TYPE_SINT64 ? VARINT_ZIGZAG
+        : VARINT_PLAIN;
+    if (field->is_map())
+    {
+        PROTO_ASSERT(plan->message->field_count == 2);
+        FieldDescriptor::CppType key_type = field->message_type()->field(0)->cpp_type();
+        plan->intkey = key_type == FieldDescriptor::CPPTYPE_INT32 || key_type == FieldDescriptor::CPPTYPE_INT64
+            || key_type == FieldDescriptor::CPPTYPE_UINT32 || key_type == FieldDescriptor::CPPTYPE_UINT64;
+    }
+    return true;
+}
+
+void free_plan(ProtoPlan* plan)
+{
+    for (size_t i = 0; i < plan->pool.size(); i++)
+        delete plan->pool[i];
+    delete[] plan->fields;
+    delete[] plan->sorted;
+    delete[] plan->absent;
+    delete[] plan->numbers;
+    delete plan;
+}
+
+const ProtoPlan* proto_plan(const Descriptor* descriptor)
+{
+    std::unordered_map<const Descriptor*, ProtoPlan*>::iterator it = g_plans.find(descriptor);
+    if (it != g_plans.end())
+        return it->second;
+
+    // registered before the fields are built, recursive types refer to it
+    ProtoPlan* plan = new ProtoPlan();
+    plan->descriptor = descriptor;
+    plan->field_count = descriptor->field_count();
+    plan->fields = new FieldPlan[plan->field_count];
+    plan->sorted = new const FieldPlan*[plan->field_count];
+    plan->absent = new const FieldPlan*[plan->field_count];
+    plan->absent_count = 0;
+    plan->oneof_count = descriptor->oneof_decl_count();
+    plan->max_number = 0;
+    plan->required = false;
+    plan->numbers = NULL;
+    g_plans[descriptor] = plan;
+    size_t mark = g_building.size();
+    g_building.push_back(plan);
+
+    for (int i = 0; i < plan->field_count; i++)
+    {
+        const FieldDescriptor* field = descriptor->field(i);
+        if (!build_field(&plan->fields[i], field))
+        {
+            // the plans built under this one may point back to it, nothing
+            // else has seen them yet. the plans around it fail in turn
+            proto_error("proto_plan build field fail, field=%s", field->full_name().c_str());
+            for (size_t j = mark; j < g_building.size(); j++)
+            {
+                g_plans.erase(g_building[j]->descriptor);
+                free_plan(g_building[j]);
+            }
+            g_building.resize(mark);
+            return NULL;
+        }
+        plan->max_number = std::max(plan->max_number, field->number());
+        plan->required = plan->required || field->is_required();
+    }
+
+    // oneof members and singular messages stay nil, a missing required
+    // field is an error
+    for (int i = 0; i < plan->field_count; i++)
+    {
+        const FieldPlan* field = &plan->fields[i];
+        if (field->label == PLAN_OPTIONAL && (field->oneof >= 0 || field->message))
+            continue;
+        plan->absent[plan->absent_count++] = field;
+    }
+
+    std::vector<const FieldDescriptor*> sorted = SortFieldsByNumber(descriptor);
+    for (int i = 0; i < plan->field_count; i++)
+    {
+        plan->sorted[i] = &plan->fields[sorted[i]->index()];
+        plan->fields[sorted[i]->index()].order = i;
+    }
+
+    // a direct index by field number unless the numbers are too sparse
+    if (plan->max_number <= plan->field_count * 4 + 64)
+    {
+        plan->numbers = new short[plan->max_number + 1];
+        memset(plan->numbers, -1, sizeof(short) * (plan->max_number + 1));
+        for (int i = 0; i < plan->field_count; i++)
+            plan->numbers[plan->fields[i].number] = (short)i;
+    }
+
+    if (mark == 0)
+        g_building.clear();
+    return plan;
+}
+
+void proto_clear_plans()
+{
+    std::unordered_map<const Descriptor*, ProtoPlan*>::iterator it = g_plans.begin();
+    for (; it != g_plans.end(); ++it)
+        free_plan(it->second);
+    g_plans.clear();
+    g_epoch++;
+}
+
+void proto_trim_pools(int size)
+{
+    std::unordered_map<const Descriptor*, ProtoPlan*>::iterator it = g_plans.begin();
+    for (; it != g_plans.end(); ++it)
+    {
+        std::vector<Message*>& pool = it->second->pool;
+        for (size_t i = size; i < pool.size(); i++)
+            delete pool[i];
+        if (pool.size() > (size_t)size)
+            pool.resize(size);
+    }
+}
+
+void proto_release_plans(const std::set<const FileDescriptor*>& files)
+{
+    std::unordered_map<const Descriptor*, ProtoPlan*>::iterator it = g_plans.begin();
+    while (it != g_plans.end())
+    {
+        if (files.count(it->first->file()) == 0)
+        {
+            ++it;
+            continue;
+        }
+
+        free_plan(it->second);
+        it = g_plans.erase(it);
+    }
+    g_epoch++;
+}
+
+// push the table of this state keyed by plan, at 1 it holds the g_epoch it
+// was made in. freed plans can leave their address to new ones, so it is
+// made again when the epoch moved on
+void push_plan_table(lua_State* L, const void* key)
+{
+    lua_pushlightuserdata(L, (void*)key);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_type(L, -1) == LUA_TTABLE)
+    {
+        lua_rawgeti(L, -1, 1);
+        bool current = lua_tointeger(L, -1) == g_epoch;
+        lua_pop(L, 1);
+        if (current)
+            return;
+    }
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushinteger(L, g_epoch);
+    lua_rawseti(L, -2, 1);
+    lua_pushlightuserdata(L, (void*)key);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+void proto_push_names(const ProtoPlan* plan, lua_State* L)
+{
+    push_plan_table(L, &g_namesKey);
+    lua_pushlightuserdata(L, (void*)plan);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, plan->field_count, plan->field_count);
+        for (int i = 0; i < plan->field_count; i++)
+        {
+            lua_pushstring(L, plan->fields[i].name);
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, -3, i + 1);
+            lua_pushinteger(L, i + 1);
+            lua_rawset(L, -3);
+        }
+        lua_pushlightuserdata(L, (void*)plan);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);
+}
+
+int readonly_newindex(lua_State* L)
+{
+    return luaL_error(L, "proto default value is read only, assign a new table to the field");
+}
+
+// an empty table that can't be written to
+void push_readonly(lua_State* L)
+{
+    lua_newtable(L);
+    lua_createtable(L, 0, 2);
+    lua_pushcfunction(L, readonly_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushboolean(L, 0);
+    lua_setfield(L, -2, "__metatable");
+    lua_setmetatable(L, -2);
+}
+
+bool proto_push_defaults(const ProtoPlan* plan, lua_State* L)
+{
+    push_plan_table(L, &g_defaultsKey);
+    lua_pushlightuserdata(L, (void*)plan);
+    lua_rawget(L, -2);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_createtable(L, 0, plan->absent_count);
+        for (int i = 0; i < plan->absent_count; i++)
+        {
+            const FieldPlan* field = plan->absent[i];
+            if (field->label == PLAN_REQUIRED)
+                continue;
+
+            lua_pushstring(L, field->name);
+            if (field->label == PLAN_MAP || field->label == PLAN_REPEATED)
+                push_readonly(L);
+            else
+                PROTO_DO(field->fill(field, L));
+            lua_rawset(L, -3);
+        }
+
+        lua_createtable(L, 0, 2);
+        lua_insert(L, -2);
+        lua_setfield(L, -2, "__index");
+        lua_pushboolean(L, 0);
+        lua_setfield(L, -2, "__metatable");
+        lua_pushlightuserdata(L, (void*)plan);
+        lua_pushvalue(L, -2);
+        lua_rawset(L, -4);
+    }
+    lua_remove(L, -2);
+    return true;
+}
+
+int collect_fields(const ProtoPlan* plan, lua_State* L, int index, int names, const FieldPlan** present, int limit)
+{
+    bool check = g_options.unknown == PROTO_UNKNOWN_ERROR;
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        lua_pop(L, 1);
+        int field = 0;
+        if (lua_type(L, -1) == LUA_TSTRING)
+        {
+            lua_pushvalue(L, -1);
+            lua_rawget(L, names);
+            field = (int)lua_tointeger(L, -1);
+            lua_pop(L, 1);
+        }
+
+        if (field == 0)
+        {
+            if (!check)
+                continue;
+            lua_pushvalue(L, -1);
+            proto_error("proto_present unknown field, proto=%s, key=%s", plan->descriptor->full_name().c_str(),
+                lua_type(L, -1) == LUA_TSTRING || lua_type(L, -1) == LUA_TNUMBER ? lua_tostring(L, -1) : luaL_typename(L, -1));
+            lua_pop(L, 2);
+            return PLAN_UNKNOWN;
+        }
+
+        if (count < limit)
+        {
+            present[count++] = &plan->fields[field - 1];
+        }
+        else if (!check)
+        {
+            lua_pop(L, 1);
+            return PLAN_DENSE;
+        }
+        else
+        {
+            count = limit + 1;
+        }
+    }
+
+    if (count > limit)
+        return PLAN_DENSE;
+
+    // by number, the same order the dense walk writes in
+    for (int i = 1; i < count; i++)
+    {
+        const FieldPlan* field = present[i];
+        int j = i - 1;
+        for (; j >= 0 && present[j]->number > field->number; j--)
+            present[j + 1] = present[j];
+        present[j + 1] = field;
+    }
+    return count;
+}
+
+int proto_present(const ProtoPlan* plan, lua_State* L, int index, int names, const FieldPlan** present)
+{
+    // fields behind __index don't show up in lua_next
+    int limit = std::min(plan->field_count / 4, PLAN_SPARSE_MAX);
+    if (plan->field_count < PLAN_SPARSE_MIN || plan->required)
+        limit = 0;
+    else if (!g_options.raw && lua_getmetatable(L, index))
+    {
+        lua_pop(L, 1);
+        limit = 0;
+    }
+
+    if (limit == 0 && g_options.unknown != PROTO_UNKNOWN_ERROR)
+        return PLAN_DENSE;
+
+    int count = collect_fields(plan, L, index, names, present, limit);
+    if (count == PLAN_UNKNOWN)
+        return PLAN_UNKNOWN;
+    return limit == 0 ? PLAN_DENSE : count;
+}
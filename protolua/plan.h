@@ -0,0 +1,126 @@
+#ifndef _JINJIAZHANG_PROTOPLAN_H_
+#define _JINJIAZHANG_PROTOPLAN_H_
+
+#include "lua.hpp"
+#include "buffer.h"
+#include "array.h"
+#include "varint.h"
+#include "google/protobuf/descriptor.h"
+#include "google/protobuf/io/coded_stream.h"
+#include <vector>
+#include <set>
+
+namespace google { namespace protobuf { class Message; } }
+
+struct FieldPlan;
+struct ProtoPlan;
+
+typedef bool (*PlanWrite)(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index);
+typedef bool (*PlanRead)(google::protobuf::io::CodedInputStream& input, const FieldPlan* field, lua_State* L);
+typedef bool (*PlanFill)(const FieldPlan* field, lua_State* L);
+
+enum PlanLabel
+{
+    PLAN_OPTIONAL,
+    PLAN_REQUIRED,
+    PLAN_REPEATED,
+    PLAN_MAP,
+};
+
+// everything the wire codec needs to know about a field, resolved once
+struct FieldPlan
+{
+    const google::protobuf::FieldDescriptor* field;
+    const char* name;
+    int index;
+    int order;          // position in plan->sorted, the stack slot read_unpack reads it to
+    int number;
+    google::protobuf::uint32 tag;          // tag with the wire type of a single value
+    google::protobuf::uint32 packed_tag;   // length delimited tag, used by packed repeated fields
+    PlanLabel label;
+    bool packed;        // written packed
+    bool packable;      // may be read packed
+    bool presence;      // written even when it holds the default value
+    int oneof;          // index of the oneof holding the field, proto3 optional included, -1 when none
+    PlanWrite write;    // write a single value, without tag
+    PlanRead read;      // push a single value
+    PlanFill fill;      // push the default value
+    const ProtoPlan* message;   // message, group or map entry type
+    bool intkey;        // map keyed by an integer type, its keys are read and written inline
+    ArrayType array;    // element type of a repeated numeric field decoded to a typed array
+    VarintKind varint;  // how the varint elements of a packed array run are coded
+};
+
+struct ProtoPlan
+{
+    const google::protobuf::Descriptor* descriptor;
+    int field_count;
+    FieldPlan* fields;      // in declaration order, same as descriptor->field(i)
+    const FieldPlan** sorted;   // by field number, the order fields are written in
+    bool required;          // has required fields, a missing one must be seen
+    int oneof_count;
+    const FieldPlan** absent;   // fields decode still sets when they aren't on the wire
+    int absent_count;
+    int max_number;
+    short* numbers;         // field number to index, null when numbers are too sparse
+    mutable std::vector<google::protobuf::Message*> pool;  // cleared messages for the reflection path
+
+    const FieldPlan* find(int number) const
+    {
+        if (numbers)
+        {
+            if (number <= 0 || number > max_number || numbers[number] < 0)
+                return NULL;
+            return &fields[numbers[number]];
+        }
+
+        for (int i = 0; i < field_count; i++)
+        {
+            if (fields[i].number == number)
+                return &fields[i];
+        }
+        return NULL;
+    }
+};
+
+const ProtoPlan* proto_plan(const google::protobuf::Descriptor* descriptor);
+void proto_clear_plans();
+
+// delete the pooled messages past size, when the pool option is lowered
+void proto_trim_pools(int size);
+
+// the plans of the types in files, the others are kept. handles and cached
+// names resolve again
+void proto_release_plans(const std::set<const google::protobuf::FileDescriptor*>& files);
+
+// element type of the typed array a repeated numeric field decodes to,
+// ARRAY_NONE for other fields
+ArrayType field_array(const google::protobuf::FieldDescriptor* field);
+
+// push a table holding the name of fields[i] at i + 1 and i + 1 at the name,
+// the strings are created once per lua state and kept alive from its registry
+void proto_push_names(const ProtoPlan* plan, lua_State* L);
+
+// push the metatable of sparse decoded tables, its __index holds the default
+// of every field but singular messages, repeated fields and maps default to
+// a read only empty table. it is shared and hidden from getmetatable
+bool proto_push_defaults(const ProtoPlan* plan, lua_State* L);
+
+#define PLAN_SPARSE_MIN 16     // fewer fields are always read one by one
+#define PLAN_SPARSE_MAX 64     // most fields the sparse walk collects
+#define PLAN_DENSE      -1     // read the declared fields one by one
+#define PLAN_UNKNOWN    -2     // the table has a key that isn't a field
+
+// the fields set in the table at index, sorted by number into present. a
+// wide message is walked with lua_next and when the table turns out to set
+// more than a quarter of the fields it gives PLAN_DENSE. it is walked in
+// full when unknown keys are errors, names is from proto_push_names
+int proto_present(const ProtoPlan* plan, lua_State* L, int index, int names, const FieldPlan** present);
+
+// push the key of field, names is the index of the table from proto_push_names
+inline void plan_pushname(lua_State* L, int names, const FieldPlan* field)
+{
+    lua_rawgeti(L, names, field->index + 1);
+}
+
+#endif
@@ -1,12 +1,118 @@
 #include "protolua.h"
+#include <new>
 
 using namespace google::protobuf;
 using namespace google::protobuf::compiler;
 
 void proto_init(lua_State* L);
-bool proto_reload(lua_State* L);
+bool proto_reload(lua_State* L, bool full);
 void proto_map_path(const std::string &virtual_path, const std::string &disk_path);
 
+ProtoOptions g_options = { false, false, 0, PROTO_UNKNOWN_IGNORE, false, false, false, true, true, false, 0 };
+ProtoStats g_stats = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0 };
+
+#define PROTO_CACHE_SIZE 1024   // power of two
+#define PROTO_CACHE_NAME 40     // lua 5.3 only interns short strings
+
+// message types keyed by the address of the name string, which lua interns,
+// the strings are anchored in the registry so the address can't be reused.
+// the anchor table is kept under a static key of the state's registry, at 0
+// it holds a serial telling the state the cache was filled in
+struct CacheEntry
+{
+    const char* name;
+    ProtoType type;
+};
+
+static CacheEntry g_cache[PROTO_CACHE_SIZE];
+static int g_cacheCount = 0;
+static int g_cacheEpoch = 0;
+static char g_cacheKey;
+static lua_Integer g_cacheOwner = 0;    // serial of the anchor table the entries belong to
+static lua_Integer g_cacheSerial = 0;
+
+// push the anchor table of the calling state, the cache is cleared when it
+// was filled in another state or the epoch moved on
+static void push_cache_names(lua_State *L)
+{
+    lua_pushlightuserdata(L, &g_cacheKey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    if (lua_type(L, -1) == LUA_TTABLE)
+    {
+        lua_rawgeti(L, -1, 0);
+        lua_Integer owner = lua_tointeger(L, -1);
+        lua_pop(L, 1);
+        if (owner == g_cacheOwner && g_cacheEpoch == g_epoch)
+            return;
+    }
+    lua_pop(L, 1);
+
+    memset(g_cache, 0, sizeof(g_cache));
+    g_cacheCount = 0;
+    g_cacheEpoch = g_epoch;
+    g_cacheOwner = ++g_cacheSerial;
+    lua_newtable(L);
+    lua_pushinteger(L, g_cacheOwner);
+    lua_rawseti(L, -2, 0);
+    lua_pushlightuserdata(L, &g_cacheKey);
+    lua_pushvalue(L, -2);
+    lua_rawset(L, LUA_REGISTRYINDEX);
+}
+
+// resolve the message name at index, temp holds the type when it isn't cached
+static const ProtoType* lookup_type(lua_State *L, int index, ProtoType* temp)
+{
+    size_t size = 0;
+    index = lua_absindex(L, index);
+    const char* proto = lua_tolstring(L, index, &size);
+    push_cache_names(L);
+    lua_pop(L, 1);
+
+    size_t home = (size_t)((((uintptr_t)proto >> 3) * 2654435761u) & (PROTO_CACHE_SIZE - 1));
+    size_t slot = home;
+    if (size <= PROTO_CACHE_NAME)
+    {
+        while (g_cache[slot].name)
+        {
+            if (g_cache[slot].name == proto)
+            {
+                g_stats.cache_hit++;
+                return &g_cache[slot].type;
+            }
+            slot = (slot + 1) & (PROTO_CACHE_SIZE - 1);
+        }
+    }
+
+    g_stats.cache_miss++;
+    if (!proto_resolve(proto, temp))
+        return NULL;
+
+    if (size > PROTO_CACHE_NAME)
+        return temp;
+
+    // the reflection path takes the prototype from the entry too
+    temp->prototype = g_factory->GetPrototype(temp->descriptor);
+    if (temp->prototype == NULL)
+        return temp;
+
+    // a full cache gives the name the first slot it probes, the probe
+    // sequences of the others stay unbroken
+    if (g_cacheCount >= PROTO_CACHE_SIZE * 3 / 4)
+        slot = home;
+    else
+        g_cacheCount++;
+
+    lua_pushlightuserdata(L, &g_cacheKey);
+    lua_rawget(L, LUA_REGISTRYINDEX);
+    lua_pushvalue(L, index);
+    lua_rawseti(L, -2, (int)slot + 1);
+    lua_pop(L, 1);
+
+    g_cache[slot].name = proto;
+    g_cache[slot].type = *temp;
+    return &g_cache[slot].type;
+}
+
 // ret = proto.parse("person.proto")
 static int parse(lua_State *L)
 {
@@ -24,13 +130,98 @@ static int parse(lua_State *L)
     return 1;
 }
 
+// ret, report = proto.parse_all("proto", "*.proto")
+static int parse_all(lua_State *L)
+{
+    const char* dir = luaL_checkstring(L, 1);
+    const char* pattern = luaL_optstring(L, 2, "*.proto");
+    ParseReport report;
+    report.traverse = 0;
+    report.total = 0;
+    bool result = proto_parse_all(dir, pattern, L, &report);
+    if (!result)
+        proto_error("proto.parse_all fail, dir=%s", dir);
+
+    lua_pushboolean(L, result);
+    lua_newtable(L);
+    lua_newtable(L);
+    for (size_t i = 0; i < report.files.size(); i++)
+    {
+        lua_pushnumber(L, report.files[i].second);
+        lua_setfield(L, -2, report.files[i].first.c_str());
+    }
+    lua_setfield(L, -2, "files");
+    lua_pushinteger(L, (lua_Integer)report.files.size());
+    lua_setfield(L, -2, "count");
+    lua_pushnumber(L, report.traverse);
+    lua_setfield(L, -2, "traverse");
+    lua_pushnumber(L, report.total);
+    lua_setfield(L, -2, "total");
+    return 2;
+}
+
+#define PROTO_BUFFER_META "protolua.buffer"
+
+// wire input at index: a string, a lightuserdata followed by its size, or a
+// proto.buffer followed by an optional offset and size
+static const char* check_input(lua_State *L, int index, size_t* size)
+{
+    if (lua_islightuserdata(L, index))
+    {
+        const char* data = (const char*)lua_touserdata(L, index);
+        lua_Integer length = luaL_checkinteger(L, index + 1);
+        luaL_argcheck(L, data && length >= 0, index + 1, "invalid size");
+        *size = (size_t)length;
+        return data;
+    }
+
+    ProtoBuffer* buffer = (ProtoBuffer*)luaL_testudata(L, index, PROTO_BUFFER_META);
+    if (buffer)
+    {
+        lua_Integer offset = luaL_optinteger(L, index + 1, 0);
+        luaL_argcheck(L, offset >= 0 && (size_t)offset <= buffer->size(), index + 1, "offset out of range");
+        lua_Integer length = luaL_optinteger(L, index + 2, (lua_Integer)(buffer->size() - offset));
+        luaL_argcheck(L, length >= 0 && (size_t)length <= buffer->size() - offset, index + 2, "size out of range");
+        *size = (size_t)length;
+        return buffer->data() + offset;
+    }
+
+    return luaL_checklstring(L, index, size);
+}
+
+// ret = proto.load_descriptor_set("schema.desc"), the path of a protoc
+// --descriptor_set_out file, or the set itself like the decode input
+static int load_descriptor_set(lua_State *L)
+{
+    bool result = false;
+    // a serialized set starts with the tag of its first file
+    if (lua_type(L, 1) == LUA_TSTRING && lua_tostring(L, 1)[0] != '\n')
+    {
+        const char* path = lua_tostring(L, 1);
+        result = proto_load_descriptor_set(path, NULL, 0, L);
+        if (!result)
+            proto_error("proto.load_descriptor_set fail, path=%s", path);
+    }
+    else
+    {
+        size_t size = 0;
+        const char* data = check_input(L, 1, &size);
+        result = proto_load_descriptor_set(NULL, data, size, L);
+        if (!result)
+            proto_error("proto.load_descriptor_set fail, size=%d", (int)size);
+    }
+
+    lua_pushboolean(L, result);
+    return 1;
+}
+
 // is_exist = proto.exist("Person")
 static int exist(lua_State *L)
 {
     assert(lua_gettop(L) == 1);
     luaL_checktype(L, 1, LUA_TSTRING);
-    const char* proto = lua_tostring(L, 1);
-    if (!g_importer->pool()->FindMessageTypeByName(proto))
+    ProtoType temp;
+    if (!lookup_type(L, 1, &temp))
     {
         lua_pushboolean(L, 0);
     }
@@ -47,7 +238,9 @@ static int create(lua_State *L)
     assert(lua_gettop(L) == 1);
     luaL_checktype(L, 1, LUA_TSTRING);
     const char* proto = lua_tostring(L, 1);
-    if (!proto_create(proto, L))
+    ProtoType temp;
+    const ProtoType* type = lookup_type(L, 1, &temp);
+    if (!type || !proto_create(type, L))
     {
         proto_error("proto.create fail, proto=%s", proto);
         return 0;
@@ -63,7 +256,9 @@ static int encode(lua_State *L)
     luaL_checktype(L, 1, LUA_TSTRING);
     luaL_checktype(L, 2, LUA_TTABLE);
     const char* proto = lua_tostring(L, 1);
-    if (!proto_encode(proto, L, 2, 0, 0))
+    ProtoType temp;
+    const ProtoType* type = lookup_type(L, 1, &temp);
+    if (!type || !proto_encode(type, L, 2, 0, 0))
     {
         proto_error("proto.encode fail, proto=%s", proto);
         return 0;
@@ -73,21 +268,25 @@ static int encode(lua_State *L)
 }
 
 // person = proto.decode("Person", data)
+// person = proto.decode("Person", pointer, size)
+// person = proto.decode("Person", buf, offset, size)
 static int decode(lua_State *L)
 {
-    assert(lua_gettop(L) == 2);
+    assert(lua_gettop(L) >= 2);
     size_t size = 0;
     luaL_checktype(L, 1, LUA_TSTRING);
     const char* proto = lua_tostring(L, 1);
-    luaL_checktype(L, 2, LUA_TSTRING);
-    const char* data = lua_tolstring(L, 2, &size);
-    if (!proto_decode(proto, L, data, size))
+    const char* data = check_input(L, 2, &size);
+    int stack = lua_gettop(L);
+    ProtoType temp;
+    const ProtoType* type = lookup_type(L, 1, &temp);
+    if (!type || !proto_decode(type, L, data, size))
     {
         proto_error("proto.decode fail, proto=%s", proto);
         return 0;
     }
 
-    return lua_gettop(L) - 2;
+    return lua_gettop(L) - stack;
 }
 
 // data = proto.pack("Person", name, id, email)
@@ -97,7 +296,9 @@ static int pack(lua_State *L)
     int stack = lua_gettop(L);
     luaL_checktype(L, 1, LUA_TSTRING);
     const char* proto = lua_tostring(L, 1);
-    if (!proto_pack(proto, L, 2, stack, 0, 0))
+    ProtoType temp;
+    const ProtoType* type = lookup_type(L, 1, &temp);
+    if (!type || !proto_pack(type, L, 2, stack, 0, 0))
     {
         proto_error("proto.pack fail, proto=%s", proto);
         return 0;
@@ -107,26 +308,31 @@ static int pack(lua_State *L)
 }
 
 // name, id, email = proto.unpack("Person", data)
+// name, id, email = proto.unpack("Person", pointer, size)
+// name, id, email = proto.unpack("Person", buf, offset, size)
 static int unpack(lua_State *L)
 {
-    assert(lua_gettop(L) == 2);
+    assert(lua_gettop(L) >= 2);
     size_t size = 0;
     luaL_checktype(L, 1, LUA_TSTRING);
     const char* proto = lua_tostring(L, 1);
-    const char* data = lua_tolstring(L, 2, &size);
-    if (!proto_unpack(proto, L, data, size))
+    const char* data = check_input(L, 2, &size);
+    int stack = lua_gettop(L);
+    ProtoType temp;
+    const ProtoType* type = lookup_type(L, 1, &temp);
+    if (!type || !proto_unpack(type, L, data, size))
     {
         proto_error("proto.unpack fail, proto=%s", proto);
         return 0;
     }
     
-    return lua_gettop(L) - 2;
+    return lua_gettop(L) - stack;
 }
 
-// proto.reload()
+// proto.reload(), proto.reload(true) parses every file again
 static int reload(lua_State *L)
 {
-    if (!proto_reload(L))
+    if (!proto_reload(L, lua_toboolean(L, 1) != 0))
     {
         lua_pushboolean(L, false);
         return 1;
@@ -146,8 +352,535 @@ static int map_path(lua_State *L)
     return 0;
 }
 
+#define PROTO_TYPE_META "protolua.type"
+
+// the userdata behind proto.type, the message name is stored right after it
+struct TypeHandle
+{
+    ProtoType type;
+};
+
+static bool resolve_handle(TypeHandle* handle)
+{
+    const char* proto = (const char*)(handle + 1);
+    PROTO_DO(proto_resolve(proto, &handle->type));
+    handle->type.prototype = g_factory->GetPrototype(handle->type.descriptor);
+    PROTO_ASSERT(handle->type.prototype);
+    return true;
+}
+
+static const ProtoType* check_type(lua_State *L, int index)
+{
+    TypeHandle* handle = (TypeHandle*)luaL_checkudata(L, index, PROTO_TYPE_META);
+    if (handle->type.epoch != g_epoch && !resolve_handle(handle))
+    {
+        // the type is gone after proto.reload
+        luaL_error(L, "proto.type resolve fail, proto=%s", (const char*)(handle + 1));
+    }
+    return &handle->type;
+}
+
+// person_type = proto.type("Person")
+static int type(lua_State *L)
+{
+    assert(lua_gettop(L) == 1);
+    size_t size = 0;
+    luaL_checktype(L, 1, LUA_TSTRING);
+    const char* proto = lua_tolstring(L, 1, &size);
+    TypeHandle* handle = (TypeHandle*)lua_newuserdata(L, sizeof(TypeHandle) + size + 1);
+    memcpy(handle + 1, proto, size + 1);
+    if (!resolve_handle(handle))
+    {
+        proto_error("proto.type fail, proto=%s", proto);
+        return 0;
+    }
+
+    luaL_setmetatable(L, PROTO_TYPE_META);
+    return 1;
+}
+
+// person = person_type:create()
+static int type_create(lua_State *L)
+{
+    const ProtoType* type = check_type(L, 1);
+    int stack = lua_gettop(L);
+    if (!proto_create(type, L))
+    {
+        proto_error("proto.type create fail, proto=%s", type->descriptor->full_name().c_str());
+        return 0;
+    }
+
+    return lua_gettop(L) - stack;
+}
+
+// data = person_type:encode(person)
+static int type_encode(lua_State *L)
+{
+    const ProtoType* type = check_type(L, 1);
+    luaL_checktype(L, 2, LUA_TTABLE);
+    int stack = lua_gettop(L);
+    if (!proto_encode(type, L, 2, 0, 0))
+    {
+        proto_error("proto.type encode fail, proto=%s", type->descriptor->full_name().c_str());
+        return 0;
+    }
+
+    return lua_gettop(L) - stack;
+}
+
+// person = person_type:decode(data), or pointer, size, or buf, offset, size
+static int type_decode(lua_State *L)
+{
+    const ProtoType* type = check_type(L, 1);
+    size_t size = 0;
+    const char* data = check_input(L, 2, &size);
+    int stack = lua_gettop(L);
+    if (!proto_decode(type, L, data, size))
+    {
+        proto_error("proto.type decode fail, proto=%s", type->descriptor->full_name().c_str());
+        return 0;
+    }
+
+    return lua_gettop(L) - stack;
+}
+
+// data = person_type:pack(name, id, email)
+static int type_pack(lua_State *L)
+{
+    const ProtoType* type = check_type(L, 1);
+    int stack = lua_gettop(L);
+    if (!proto_pack(type, L, 2, stack, 0, 0))
+    {
+        proto_error("proto.type pack fail, proto=%s", type->descriptor->full_name().c_str());
+        return 0;
+    }
+
+    return lua_gettop(L) - stack;
+}
+
+// name, id, email = person_type:unpack(data), inputs are the same as decode
+static int type_unpack(lua_State *L)
+{
+    const ProtoType* type = check_type(L, 1);
+    size_t size = 0;
+    const char* data = check_input(L, 2, &size);
+    int stack = lua_gettop(L);
+    if (!proto_unpack(type, L, data, size))
+    {
+        proto_error("proto.type unpack fail, proto=%s", type->descriptor->full_name().c_str());
+        return 0;
+    }
+
+    return lua_gettop(L) - stack;
+}
+
+static int type_tostring(lua_State *L)
+{
+    TypeHandle* handle = (TypeHandle*)luaL_checkudata(L, 1, PROTO_TYPE_META);
+    lua_pushfstring(L, "proto.type: %s", (const char*)(handle + 1));
+    return 1;
+}
+
+// message name or proto.type handle at index
+static const ProtoType* check_proto(lua_State *L, int index, ProtoType* temp)
+{
+    if (lua_type(L, index) == LUA_TUSERDATA)
+        return check_type(L, index);
+
+    luaL_checktype(L, index, LUA_TSTRING);
+    return lookup_type(L, index, temp);
+}
+
+static ProtoBuffer* check_buffer(lua_State *L)
+{
+    return (ProtoBuffer*)luaL_checkudata(L, 1, PROTO_BUFFER_META);
+}
+
+PROTO_API const char* proto_buffer(lua_State* L, int index, size_t* size)
+{
+    ProtoBuffer* buffer = (ProtoBuffer*)luaL_testudata(L, index, PROTO_BUFFER_META);
+    if (buffer == NULL)
+        return NULL;
+
+    *size = buffer->size();
+    return buffer->data();
+}
+
+// buf = proto.buffer()
+static int buffer(lua_State *L)
+{
+    lua_Integer capacity = luaL_optinteger(L, 1, 0);
+    ProtoBuffer* buffer = new (lua_newuserdata(L, sizeof(ProtoBuffer))) ProtoBuffer();
+    luaL_setmetatable(L, PROTO_BUFFER_META);
+    if (capacity > 0 && !buffer->reserve((size_t)capacity))
+        return luaL_error(L, "proto.buffer out of memory, capacity=%d", (int)capacity);
+    return 1;
+}
+
+// size = buf:encode("Person", person)
+static int buffer_encode(lua_State *L)
+{
+    ProtoBuffer* buffer = check_buffer(L);
+    ProtoType temp;
+    const ProtoType* type = check_proto(L, 2, &temp);
+    luaL_checktype(L, 3, LUA_TTABLE);
+    size_t size = buffer->size();
+    if (!type || !proto_encode(type, L, 3, *buffer))
+    {
+        proto_error("proto.buffer encode fail, proto=%s", type ? type->descriptor->full_name().c_str() : lua_tostring(L, 2));
+        return 0;
+    }
+
+    lua_pushinteger(L, (lua_Integer)(buffer->size() - size));
+    return 1;
+}
+
+// size = buf:pack("Person", name, id, email)
+static int buffer_pack(lua_State *L)
+{
+    ProtoBuffer* buffer = check_buffer(L);
+    ProtoType temp;
+    const ProtoType* type = check_proto(L, 2, &temp);
+    size_t size = buffer->size();
+    if (!type || !proto_pack(type, L, 3, lua_gettop(L), *buffer))
+    {
+        proto_error("proto.buffer pack fail, proto=%s", type ? type->descriptor->full_name().c_str() : lua_tostring(L, 2));
+        return 0;
+    }
+
+    lua_pushinteger(L, (lua_Integer)(buffer->size() - size));
+    return 1;
+}
+
+// buf:reset()
+static int buffer_reset(lua_State *L)
+{
+    check_buffer(L)->clear();
+    return 0;
+}
+
+// size = buf:size()
+static int buffer_size(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)check_buffer(L)->size());
+    return 1;
+}
+
+// data = buf:tostring()
+static int buffer_tostring(lua_State *L)
+{
+    ProtoBuffer* buffer = check_buffer(L);
+    lua_pushlstring(L, buffer->data(), buffer->size());
+    return 1;
+}
+
+static int buffer_gc(lua_State *L)
+{
+    check_buffer(L)->~ProtoBuffer();
+    return 0;
+}
+
+static const char* g_arrayTypes[] = { "int32", "uint32", "int64", "uint64", "float", "double", NULL };
+
+static ProtoArray* check_array(lua_State *L)
+{
+    return (ProtoArray*)luaL_checkudata(L, 1, PROTO_ARRAY_META);
+}
+
+static void array_push(lua_State *L, const ProtoArray* array, size_t i)
+{
+    if (!array->integer())
+        lua_pushnumber(L, array->get_number(i));
+    else if (array->type() == ARRAY_INT64 || array->type() == ARRAY_UINT64)
+        lua_pushint64(L, array->get_integer(i));
+    else
+        lua_pushinteger(L, (lua_Integer)array->get_integer(i));
+}
+
+static void array_set(lua_State *L, ProtoArray* array, size_t i, int index)
+{
+    luaL_argcheck(L, lua_type(L, index) == LUA_TNUMBER || lua_type(L, index) == LUA_TSTRING, index, "number expected");
+    if (array->integer())
+        array->set_integer(i, lua_toint64(L, index));
+    else
+        array->set_number(i, lua_tonumber(L, index));
+}
+
+static void array_add(lua_State *L, ProtoArray* array, int index)
+{
+    if (!array->reserve(1))
+        luaL_error(L, "proto.array out of memory, size=%d", (int)array->size());
+    array_set(L, array, array->size(), index);
+    array->advance(1);
+}
+
+// arr = proto.array("float", {1.5, 2.5})
+static int array(lua_State *L)
+{
+    ArrayType type = (ArrayType)luaL_checkoption(L, 1, NULL, g_arrayTypes);
+    ProtoArray* array = array_new(L, type);
+    if (lua_istable(L, 2))
+    {
+        int count = (int)luaL_len(L, 2);
+        if (!array->reserve(count))
+            return luaL_error(L, "proto.array out of memory, size=%d", count);
+        for (int i = 1; i <= count; i++)
+        {
+            lua_rawgeti(L, 2, i);
+            array_add(L, array, lua_gettop(L));
+            lua_pop(L, 1);
+        }
+    }
+    return 1;
+}
+
+// value = arr[i], or a method
+static int array_index(lua_State *L)
+{
+    ProtoArray* array = check_array(L);
+    if (lua_type(L, 2) != LUA_TNUMBER)
+    {
+        lua_pushvalue(L, 2);
+        lua_rawget(L, lua_upvalueindex(1));
+        return 1;
+    }
+
+    lua_Integer i = lua_tointeger(L, 2);
+    if (i < 1 || (size_t)i > array->size())
+        return 0;
+    array_push(L, array, (size_t)i - 1);
+    return 1;
+}
+
+// arr[i] = value, i may be #arr + 1 to append
+static int array_newindex(lua_State *L)
+{
+    ProtoArray* array = check_array(L);
+    lua_Integer i = luaL_checkinteger(L, 2);
+    luaL_argcheck(L, i >= 1 && (size_t)i <= array->size() + 1, 2, "index out of range");
+    if ((size_t)i == array->size() + 1)
+        array_add(L, array, 3);
+    else
+        array_set(L, array, (size_t)i - 1, 3);
+    return 0;
+}
+
+// arr:append(value) or arr:append({value, ...})
+static int array_append(lua_State *L)
+{
+    ProtoArray* array = check_array(L);
+    if (!lua_istable(L, 2))
+    {
+        array_add(L, array, 2);
+        return 0;
+    }
+
+    int count = (int)luaL_len(L, 2);
+    if (!array->reserve(count))
+        return luaL_error(L, "proto.array out of memory, size=%d", (int)array->size() + count);
+    for (int i = 1; i <= count; i++)
+    {
+        lua_rawgeti(L, 2, i);
+        array_add(L, array, lua_gettop(L));
+        lua_pop(L, 1);
+    }
+    return 0;
+}
+
+// t = arr:totable([i [, j]])
+static int array_totable(lua_State *L)
+{
+    ProtoArray* array = check_array(L);
+    lua_Integer first = luaL_optinteger(L, 2, 1);
+    lua_Integer last = luaL_optinteger(L, 3, (lua_Integer)array->size());
+    if (first < 1)
+        first = 1;
+    if (last > (lua_Integer)array->size())
+        last = (lua_Integer)array->size();
+
+    lua_createtable(L, last >= first ? (int)(last - first + 1) : 0, 0);
+    for (lua_Integer i = first; i <= last; i++)
+    {
+        array_push(L, array, (size_t)i - 1);
+        lua_rawseti(L, -2, (int)(i - first + 1));
+    }
+    return 1;
+}
+
+// name = arr:type()
+static int array_type(lua_State *L)
+{
+    lua_pushstring(L, g_arrayTypes[check_array(L)->type()]);
+    return 1;
+}
+
+static int array_len(lua_State *L)
+{
+    lua_pushinteger(L, (lua_Integer)check_array(L)->size());
+    return 1;
+}
+
+static int array_gc(lua_State *L)
+{
+    check_array(L)->~ProtoArray();
+    return 0;
+}
+
+// the allocator of a state with the alloc option on, in front of the one it had
+struct CountingAlloc
+{
+    lua_Alloc alloc;
+    void* ud;
+    long long count;    // blocks handed out or grown
+};
+
+static void* counting_alloc(void* ud, void* ptr, size_t osize, size_t nsize)
+{
+    CountingAlloc* counting = (CountingAlloc*)ud;
+    if (nsize > 0 && (ptr == NULL || nsize > osize))
+        counting->count++;
+    return counting->alloc(counting->ud, ptr, osize, nsize);
+}
+
+// stats = proto.stats()
+static int stats(lua_State *L)
+{
+    lua_newtable(L);
+    lua_pushinteger(L, (lua_Integer)g_stats.cache_hit);
+    lua_setfield(L, -2, "cache_hit");
+    lua_pushinteger(L, (lua_Integer)g_stats.cache_miss);
+    lua_setfield(L, -2, "cache_miss");
+    lua_pushinteger(L, (lua_Integer)g_stats.arena_calls);
+    lua_setfield(L, -2, "arena_calls");
+    lua_pushinteger(L, (lua_Integer)g_stats.arena_overflow);
+    lua_setfield(L, -2, "arena_overflow");
+    lua_pushinteger(L, (lua_Integer)g_stats.pool_hit);
+    lua_setfield(L, -2, "pool_hit");
+    lua_pushinteger(L, (lua_Integer)g_stats.pool_miss);
+    lua_setfield(L, -2, "pool_miss");
+    lua_pushstring(L, varint_kernels(g_options.simd)->name);
+    lua_setfield(L, -2, "varint");
+    lua_pushstring(L, g_options.utf8 ? utf8_kernel(g_options.simd)->name : "off");
+    lua_setfield(L, -2, "utf8");
+    lua_pushinteger(L, (lua_Integer)g_stats.utf8_checked);
+    lua_setfield(L, -2, "utf8_checked");
+    lua_pushinteger(L, (lua_Integer)g_stats.utf8_bytes);
+    lua_setfield(L, -2, "utf8_bytes");
+    lua_pushinteger(L, (lua_Integer)g_stats.utf8_skipped);
+    lua_setfield(L, -2, "utf8_skipped");
+    lua_pushinteger(L, (lua_Integer)g_stats.reload_full);
+    lua_setfield(L, -2, "reload_full");
+    lua_pushinteger(L, (lua_Integer)g_stats.reload_files);
+    lua_setfield(L, -2, "reload_files");
+
+    void* ud = NULL;
+    if (lua_getallocf(L, &ud) == counting_alloc)
+    {
+        lua_pushinteger(L, (lua_Integer)((CountingAlloc*)ud)->count);
+        lua_setfield(L, -2, "lua_alloc");
+    }
+    return 1;
+}
+
+static int option_bool(lua_State *L, bool* value)
+{
+    lua_pushboolean(L, *value);
+    if (!lua_isnoneornil(L, 2))
+        *value = lua_toboolean(L, 2) != 0;
+    return 1;
+}
+
+static int option_int(lua_State *L, int* value, int min, int max)
+{
+    lua_pushinteger(L, *value);
+    if (!lua_isnoneornil(L, 2))
+    {
+        lua_Integer n = luaL_checkinteger(L, 2);
+        luaL_argcheck(L, n >= min && n <= max, 2, "option out of range");
+        *value = (int)n;
+    }
+    return 1;
+}
+
+// old = proto.option("unknown", "error")
+static int option_unknown(lua_State *L)
+{
+    static const char* names[] = { "ignore", "error", NULL };
+    lua_pushstring(L, names[g_options.unknown]);
+    if (!lua_isnoneornil(L, 2))
+        g_options.unknown = (ProtoUnknown)luaL_checkoption(L, 2, NULL, names);
+    return 1;
+}
+
+// old = proto.option("alloc", true), counts what the state allocates until turned off
+static int option_alloc(lua_State *L)
+{
+    void* ud = NULL;
+    lua_Alloc alloc = lua_getallocf(L, &ud);
+    bool counting = alloc == counting_alloc;
+    lua_pushboolean(L, counting);
+    if (lua_isnoneornil(L, 2) || (lua_toboolean(L, 2) != 0) == counting)
+        return 1;
+
+    if (!counting)
+    {
+        CountingAlloc* wrapper = (CountingAlloc*)alloc(ud, NULL, 0, sizeof(CountingAlloc));
+        if (!wrapper)
+            return luaL_error(L, "proto.option alloc out of memory");
+        wrapper->alloc = alloc;
+        wrapper->ud = ud;
+        wrapper->count = 0;
+        lua_setallocf(L, counting_alloc, wrapper);
+    }
+    else
+    {
+        CountingAlloc* wrapper = (CountingAlloc*)ud;
+        lua_setallocf(L, wrapper->alloc, wrapper->ud);
+        wrapper->alloc(wrapper->ud, wrapper, sizeof(CountingAlloc), 0);
+    }
+    return 1;
+}
+
+// old = proto.option("reflection", true)
+static int option(lua_State *L)
+{
+    const char* name = luaL_checkstring(L, 1);
+    if (strcmp(name, "reflection") == 0)
+        return option_bool(L, &g_options.reflection);
+    if (strcmp(name, "raw") == 0)
+        return option_bool(L, &g_options.raw);
+    if (strcmp(name, "pool") == 0)
+    {
+        option_int(L, &g_options.pool, 0, 1024);
+        proto_trim_pools(g_options.pool);
+        return 1;
+    }
+    if (strcmp(name, "unknown") == 0)
+        return option_unknown(L);
+    if (strcmp(name, "sparse") == 0)
+        return option_bool(L, &g_options.sparse);
+    if (strcmp(name, "dense") == 0)
+        return option_bool(L, &g_options.dense);
+    if (strcmp(name, "array") == 0)
+        return option_bool(L, &g_options.array);
+    if (strcmp(name, "simd") == 0)
+        return option_bool(L, &g_options.simd);
+    if (strcmp(name, "utf8") == 0)
+        return option_bool(L, &g_options.utf8);
+    if (strcmp(name, "lazy") == 0)
+        return option_bool(L, &g_options.lazy);
+    if (strcmp(name, "threads") == 0)
+        return option_int(L, &g_options.threads, 0, 64);
+    if (strcmp(name, "alloc") == 0)
+        return option_alloc(L);
+
+    return luaL_error(L, "proto.option unknow option, name=%s", name);
+}
+
 static const struct luaL_Reg protoLib[] = {
         {"parse",    parse},
+        {"parse_all", parse_all},
+        {"load_descriptor_set", load_descriptor_set},
         {"exist",    exist},
         {"create",   create},
         {"encode",   encode},
@@ -156,12 +889,73 @@ static const struct luaL_Reg protoLib[] = {
         {"unpack",   unpack},
         {"reload",   reload},
         {"map_path", map_path},
+        {"option",   option},
+        {"type",     type},
+        {"stats",    stats},
+        {"buffer",   buffer},
+        {"array",    array},
+        {NULL, NULL}
+};
+
+static const struct luaL_Reg typeLib[] = {
+        {"create",   type_create},
+        {"encode",   type_encode},
+        {"decode",   type_decode},
+        {"pack",     type_pack},
+        {"unpack",   type_unpack},
+        {NULL, NULL}
+};
+
+static const struct luaL_Reg arrayLib[] = {
+        {"append",   array_append},
+        {"totable",  array_totable},
+        {"type",     array_type},
+        {NULL, NULL}
+};
+
+static const struct luaL_Reg bufferLib[] = {
+        {"encode",   buffer_encode},
+        {"pack",     buffer_pack},
+        {"reset",    buffer_reset},
+        {"size",     buffer_size},
+        {"tostring", buffer_tostring},
         {NULL, NULL}
 };
 
 PROTO_API int luaopen_protolua(lua_State* L)
 {
     proto_init(L);
+    luaL_newmetatable(L, PROTO_TYPE_META);
+    lua_newtable(L);
+    luaL_setfuncs(L, typeLib, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, type_tostring);
+    lua_setfield(L, -2, "__tostring");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, PROTO_BUFFER_META);
+    lua_newtable(L);
+    luaL_setfuncs(L, bufferLib, 0);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, buffer_size);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, buffer_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
+    luaL_newmetatable(L, PROTO_ARRAY_META);
+    lua_newtable(L);
+    luaL_setfuncs(L, arrayLib, 0);
+    lua_pushcclosure(L, array_index, 1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, array_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, array_len);
+    lua_setfield(L, -2, "__len");
+    lua_pushcfunction(L, array_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_pop(L, 1);
+
     lua_newtable(L);
     luaL_setfuncs(L, protoLib, 0);
     lua_setglobal(L, "proto");
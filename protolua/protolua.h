@@ -9,6 +9,10 @@
 
 #include "google/protobuf/dynamic_message.h"
 #include "google/protobuf/compiler/importer.h"
+#include "arena.h"
+#include "buffer.h"
+#include "plan.h"
+#include "utf8.h"
 
 #ifdef _JINJIAZHANG_PROTOLOG_H_
 #define proto_trace(fmt, ...)  log_trace(fmt, __VA_ARGS__)
@@ -43,14 +47,84 @@
 #define PROTO_DO(exp) { if(!(exp)) return false; }
 #define PROTO_ASSERT(exp) { if(!(exp)) return false; }
 
+enum ProtoUnknown
+{
+    PROTO_UNKNOWN_IGNORE,
+    PROTO_UNKNOWN_ERROR,
+};
+
+struct ProtoOptions
+{
+    bool reflection;    // go through DynamicMessage instead of the wire format reader/writer
+    bool raw;           // encode reads fields with lua_rawget, skipping __index
+    int pool;           // cleared messages kept per type by the reflection path, 0 uses the arena
+    ProtoUnknown unknown;   // what encode does with a key that isn't a field
+    bool sparse;        // decode leaves absent fields to a shared defaults metatable
+    bool dense;         // decode presizes maps keyed 1..n in the array part
+    bool array;         // decode repeated numeric fields to proto.array userdata
+    bool simd;          // packed varint runs of arrays and utf8 checks go through the vector kernels
+    bool utf8;          // decode checks that proto3 string fields are valid utf8
+    bool lazy;          // parse and load_descriptor_set leave building types to their first use
+    int threads;        // workers parsing .proto files ahead of the build, 0 or 1 parses on the calling thread
+};
+
+struct ProtoStats
+{
+    long long cache_hit;    // message name found in the lookup cache
+    long long cache_miss;   // message name resolved through the descriptor pool
+    long long arena_calls;  // reflection calls on the retained arena
+    long long arena_overflow;   // of which outgrew its first block and hit malloc
+    long long pool_hit;     // reflection message reused from the pool
+    long long pool_miss;    // reflection message allocated while pooling
+    long long utf8_checked; // proto3 strings validated by decode
+    long long utf8_bytes;   // of which bytes
+    long long utf8_skipped; // proto3 strings read as bytes with the utf8 option off
+    long long reload_full;  // reloads that built every file again
+    long long reload_files; // files built again by incremental reloads
+};
+
+// a message type resolved once, good until the epoch changes on proto.reload
+struct ProtoType
+{
+    const google::protobuf::Descriptor* descriptor;
+    const google::protobuf::Message* prototype;     // null when not resolved yet
+    const ProtoPlan* plan;
+    int epoch;      // plans and descriptors are released when g_epoch moves on
+};
+
+// what proto.parse_all took, in seconds
+struct ParseReport
+{
+    std::vector<std::pair<std::string, double> > files;
+    double traverse;    // defining the enums
+    double total;
+};
+
 bool proto_parse(const char* file, lua_State* L);
+bool proto_parse_all(const char* dir, const char* pattern, lua_State* L, ParseReport* report);
+bool proto_load_descriptor_set(const char* path, const char* data, size_t size, lua_State* L);
 bool proto_create(const char* proto, lua_State* L);
 bool proto_encode(const char* proto, lua_State* L, int index, char* output, size_t* size);
+// input is read in place, it may point into a receive buffer or a proto.buffer
 bool proto_decode(const char* proto, lua_State* L, const char* input, size_t size);
 bool proto_pack(const char* proto, lua_State* L, int start, int end, char* output, size_t* size);
 bool proto_unpack(const char* proto, lua_State* L, const char* input, size_t size);
 
-extern google::protobuf::compiler::Importer* g_importer;
+bool proto_resolve(const char* proto, ProtoType* type);
+bool proto_create(const ProtoType* type, lua_State* L);
+bool proto_encode(const ProtoType* type, lua_State* L, int index, char* output, size_t* size);
+bool proto_decode(const ProtoType* type, lua_State* L, const char* input, size_t size);
+bool proto_pack(const ProtoType* type, lua_State* L, int start, int end, char* output, size_t* size);
+bool proto_unpack(const ProtoType* type, lua_State* L, const char* input, size_t size);
+bool proto_encode(const ProtoType* type, lua_State* L, int index, ProtoBuffer& buffer);
+bool proto_pack(const ProtoType* type, lua_State* L, int start, int end, ProtoBuffer& buffer);
+
+// data and size of the proto.buffer at index, null when it isn't one
+PROTO_API const char* proto_buffer(lua_State* L, int index, size_t* size);
+
 extern google::protobuf::DynamicMessageFactory* g_factory;
+extern ProtoOptions g_options;
+extern ProtoStats g_stats;
+extern int g_epoch;
 
 #endif
\ No newline at end of file
@@ -0,0 +1,962 @@
+#include "protolua.h"
+#include <limits.h>
+#include "google/protobuf/wire_format_lite.h"
+
+using namespace google::protobuf;
+using namespace google::protobuf::io;
+using namespace google::protobuf::internal;
+
+bool read_field(CodedInputStream& input, const FieldPlan* field, uint32 tag, lua_State* L, int index, int names);
+bool read_single(CodedInputStream& input, const FieldPlan* field, lua_State* L, int index, int names);
+bool read_repeated(CodedInputStream& input, const FieldPlan* field, uint32 tag, lua_State* L, int index, int names);
+bool read_table(CodedInputStream& input, const FieldPlan* field, lua_State* L, int index, int names);
+bool read_array(CodedInputStream& input, const FieldPlan* field, uint32 tag, lua_State* L, int index, int names);
+bool read_intmap(CodedInputStream& input, const FieldPlan* field, lua_State* L, int index, int names);
+bool read_fields(CodedInputStream& input, const ProtoPlan* plan, lua_State* L, int index, bool merge);
+bool read_wire(CodedInputStream& input, const ProtoPlan* plan, lua_State* L, int index, int names, bool merge);
+bool read_message(CodedInputStream& input, const ProtoPlan* plan, lua_State* L);
+
+// which fields of a message have been seen on the wire
+class FieldMarks
+{
+public:
+    FieldMarks(int count) : marks_(count <= (int)sizeof(local_) ? local_ : new bool[count])
+    {
+        memset(marks_, 0, count);
+    }
+    ~FieldMarks() { if (marks_ != local_) delete[] marks_; }
+
+    bool test(int index) const { return marks_[index]; }
+    void set(int index) { marks_[index] = true; }
+
+private:
+    FieldMarks(const FieldMarks&);
+    FieldMarks& operator=(const FieldMarks&);
+
+private:
+    bool* marks_;
+    bool local_[64];
+};
+
+// the member of each oneof last seen on the wire
+class OneofCases
+{
+public:
+    OneofCases(int count) : cases_(count <= (int)(sizeof(local_) / sizeof(local_[0])) ? local_ : new const FieldPlan*[count])
+    {
+        memset(cases_, 0, sizeof(const FieldPlan*) * count);
+    }
+    ~OneofCases() { if (cases_ != local_) delete[] cases_; }
+
+    const FieldPlan* get(int oneof) const { return cases_[oneof]; }
+    void set(int oneof, const FieldPlan* field) { cases_[oneof] = field; }
+
+private:
+    OneofCases(const OneofCases&);
+    OneofCases& operator=(const OneofCases&);
+
+private:
+    const FieldPlan** cases_;
+    const FieldPlan* local_[16];
+};
+
+// push the value of field in the table at index. names 0 means index is
+// the first of the stack slots read_unpack reads into, one per field
+inline void field_push(lua_State* L, int index, int names, const FieldPlan* field)
+{
+    if (names == 0)
+    {
+        lua_pushvalue(L, index + field->order);
+        return;
+    }
+    plan_pushname(L, names, field);
+    lua_rawget(L, index);
+}
+
+// pop the value on top into field, a table or a stack slot like field_push
+inline void field_store(lua_State* L, int index, int names, const FieldPlan* field)
+{
+    if (names == 0)
+    {
+        lua_replace(L, index + field->order);
+        return;
+    }
+    plan_pushname(L, names, field);
+    lua_insert(L, -2);
+    lua_rawset(L, index);
+}
+
+// push the repeated or map container of field, created on first use
+inline void read_container(const FieldPlan* field, lua_State* L, int index, int names)
+{
+    field_push(L, index, names, field);
+    if (lua_isnil(L, -1))
+    {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        field_store(L, index, names, field);
+    }
+}
+
+inline int container_size(lua_State* L, int index)
+{
+#if LUA_VERSION_NUM == 501
+    return (int)lua_objlen(L, index);
+#else
+    return (int)lua_rawlen(L, index);
+#endif
+}
+
+bool read_double(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadLittleEndian64(&value));
+    lua_pushnumber(L, WireFormatLite::DecodeDouble(value));
+    return true;
+}
+
+bool read_float(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadLittleEndian32(&value));
+    lua_pushnumber(L, WireFormatLite::DecodeFloat(value));
+    return true;
+}
+
+bool read_int64(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadVarint64(&value));
+    lua_pushint64(L, (int64)value);
+    return true;
+}
+
+bool read_uint64(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadVarint64(&value));
+    lua_pushint64(L, value);
+    return true;
+}
+
+bool read_int32(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadVarint32(&value));
+    lua_pushinteger(L, (int32)value);
+    return true;
+}
+
+bool read_uint32(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadVarint32(&value));
+    lua_pushinteger(L, value);
+    return true;
+}
+
+bool read_sint32(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadVarint32(&value));
+    lua_pushinteger(L, WireFormatLite::ZigZagDecode32(value));
+    return true;
+}
+
+bool read_sint64(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadVarint64(&value));
+    lua_pushint64(L, WireFormatLite::ZigZagDecode64(value));
+    return true;
+}
+
+bool read_fixed32(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadLittleEndian32(&value));
+    lua_pushinteger(L, value);
+    return true;
+}
+
+bool read_fixed64(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadLittleEndian64(&value));
+    lua_pushint64(L, value);
+    return true;
+}
+
+bool read_sfixed32(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadLittleEndian32(&value));
+    lua_pushinteger(L, (int32)value);
+    return true;
+}
+
+bool read_sfixed64(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadLittleEndian64(&value));
+    lua_pushint64(L, (int64)value);
+    return true;
+}
+
+bool read_bool(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint64 value = 0;
+    PROTO_DO(input.ReadVarint64(&value));
+    lua_pushboolean(L, value != 0);
+    return true;
+}
+
+bool read_enum(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    uint32 value = 0;
+    PROTO_DO(input.ReadVarint32(&value));
+    lua_pushinteger(L, (int)value);
+    return true;
+}
+
+bool read_bytes(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    int length = 0;
+    PROTO_DO(input.ReadVarintSizeAsInt(&length));
+
+    const void* data = NULL;
+    int size = 0;
+    input.GetDirectBufferPointerInline(&data, &size);
+    if (size >= length)
+    {
+        lua_pushlstring(L, (const char*)data, length);
+        return input.Skip(length);
+    }
+
+    std::string value;
+    PROTO_DO(input.ReadString(&value, length));
+    lua_pushlstring(L, value.c_str(), value.size());
+    return true;
+}
+
+// proto3 string fields must hold valid utf8, like ParseFromArray checks,
+// unless the utf8 option reads them as bytes
+bool read_utf8(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    PROTO_DO(read_bytes(input, field, L));
+    if (!g_options.utf8)
+    {
+        g_stats.utf8_skipped++;
+        return true;
+    }
+
+    size_t length = 0;
+    const char* data = lua_tolstring(L, -1, &length);
+    g_stats.utf8_checked++;
+    g_stats.utf8_bytes += length;
+    if (!utf8_kernel(g_options.simd)->valid((const uint8_t*)data, length))
+    {
+        proto_error("read_utf8 invalid utf8 data, field=%s", field->field->full_name().c_str());
+        return false;
+    }
+    return true;
+}
+
+bool read_group(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    PROTO_DO(input.IncrementRecursionDepth());
+    PROTO_DO(read_message(input, field->message, L));
+    PROTO_DO(input.LastTagWas(WireFormatLite::MakeTag(field->number, WireFormatLite::WIRETYPE_END_GROUP)));
+    input.DecrementRecursionDepth();
+    return true;
+}
+
+bool read_submessage(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    int length = 0;
+    PROTO_DO(input.ReadVarintSizeAsInt(&length));
+    CodedInputStream::Limit limit = input.PushLimit(length);
+    PROTO_DO(input.IncrementRecursionDepth());
+    PROTO_DO(read_message(input, field->message, L));
+    PROTO_DO(input.ConsumedEntireMessage());
+    input.DecrementRecursionDepth();
+    input.PopLimit(limit);
+    return true;
+}
+
+PlanRead read_handler(const FieldDescriptor* field)
+{
+    switch (field->type())
+    {
+    case FieldDescriptor::TYPE_DOUBLE:      return read_double;
+    case FieldDescriptor::TYPE_FLOAT:       return read_float;
+    case FieldDescriptor::TYPE_INT64:       return read_int64;
+    case FieldDescriptor::TYPE_UINT64:      return read_uint64;
+    case FieldDescriptor::TYPE_INT32:       return read_int32;
+    case FieldDescriptor::TYPE_FIXED64:     return read_fixed64;
+    case FieldDescriptor::TYPE_FIXED32:     return read_fixed32;
+    case FieldDescriptor::TYPE_BOOL:        return read_bool;
+    case FieldDescriptor::TYPE_GROUP:       return read_group;
+    case FieldDescriptor::TYPE_MESSAGE:     return read_submessage;
+    case FieldDescriptor::TYPE_BYTES:       return read_bytes;
+    case FieldDescriptor::TYPE_UINT32:      return read_uint32;
+    case FieldDescriptor::TYPE_ENUM:        return read_enum;
+    case FieldDescriptor::TYPE_SFIXED32:    return read_sfixed32;
+    case FieldDescriptor::TYPE_SFIXED64:    return read_sfixed64;
+    case FieldDescriptor::TYPE_SINT32:      return read_sint32;
+    case FieldDescriptor::TYPE_SINT64:      return read_sint64;
+    case FieldDescriptor::TYPE_STRING:
+        if (field->file()->syntax() == FileDescriptor::SYNTAX_PROTO3)
+            return read_utf8;
+        return read_bytes;
+    default:
+        proto_error("read_handler field unknow type, field=%s", field->full_name().c_str());
+        return NULL;
+    }
+}
+
+bool fill_double(const FieldPlan* field, lua_State* L)
+{
+    lua_pushnumber(L, field->field->default_value_double());
+    return true;
+}
+
+bool fill_float(const FieldPlan* field, lua_State* L)
+{
+    lua_pushnumber(L, field->field->default_value_float());
+    return true;
+}
+
+bool fill_int32(const FieldPlan* field, lua_State* L)
+{
+    lua_pushinteger(L, field->field->default_value_int32());
+    return true;
+}
+
+bool fill_uint32(const FieldPlan* field, lua_State* L)
+{
+    lua_pushinteger(L, field->field->default_value_uint32());
+    return true;
+}
+
+bool fill_int64(const FieldPlan* field, lua_State* L)
+{
+    lua_pushint64(L, field->field->default_value_int64());
+    return true;
+}
+
+bool fill_uint64(const FieldPlan* field, lua_State* L)
+{
+    lua_pushint64(L, field->field->default_value_uint64());
+    return true;
+}
+
+bool fill_enum(const FieldPlan* field, lua_State* L)
+{
+    lua_pushinteger(L, field->field->default_value_enum()->number());
+    return true;
+}
+
+bool fill_bool(const FieldPlan* field, lua_State* L)
+{
+    lua_pushboolean(L, field->field->default_value_bool());
+    return true;
+}
+
+bool fill_string(const FieldPlan* field, lua_State* L)
+{
+    const std::string& value = field->field->default_value_string();
+    lua_pushlstring(L, value.c_str(), value.size());
+    return true;
+}
+
+// an empty message, every field at its default
+bool fill_message(const FieldPlan* field, lua_State* L)
+{
+    CodedInputStream empty(NULL, 0);
+    return read_message(empty, field->message, L);
+}
+
+PlanFill fill_handler(const FieldDescriptor* field)
+{
+    switch (field->cpp_type())
+    {
+    case FieldDescriptor::CPPTYPE_DOUBLE:   return fill_double;
+    case FieldDescriptor::CPPTYPE_FLOAT:    return fill_float;
+    case FieldDescriptor::CPPTYPE_INT32:    return fill_int32;
+    case FieldDescriptor::CPPTYPE_UINT32:   return fill_uint32;
+    case FieldDescriptor::CPPTYPE_INT64:    return fill_int64;
+    case FieldDescriptor::CPPTYPE_UINT64:   return fill_uint64;
+    case FieldDescriptor::CPPTYPE_ENUM:     return fill_enum;
+    case FieldDescriptor::CPPTYPE_BOOL:     return fill_bool;
+    case FieldDescriptor::CPPTYPE_STRING:   return fill_string;
+    case FieldDescriptor::CPPTYPE_MESSAGE:  return fill_message;
+    default:
+        proto_error("fill_handler field unknow type, field=%s", field->full_name().c_str());
+        return NULL;
+    }
+}
+
+bool read_field(CodedInputStream& input, const FieldPlan* field, uint32 tag, lua_State* L, int index, int names)
+{
+    switch (field->label)
+    {
+    case PLAN_MAP:
+        return read_table(input, field, L, index, names);
+    case PLAN_REPEATED:
+        return read_repeated(input, field, tag, L, index, names);
+    default:
+        return read_single(input, field, L, index, names);
+    }
+}
+
+bool read_single(CodedInputStream& input, const FieldPlan* field, lua_State* L, int index, int names)
+{
+    if (field->message)
+    {
+        // a message seen twice on the wire is merged into the first one
+        field_push(L, index, names, field);
+        if (lua_istable(L, -1))
+        {
+            int table = lua_gettop(L);
+            if (field->field->type() == FieldDescriptor::TYPE_GROUP)
+            {
+                PROTO_DO(input.IncrementRecursionDepth());
+                PROTO_DO(read_fields(input, field->message, L, table, true));
+                PROTO_DO(input.LastTagWas(WireFormatLite::MakeTag(field->number, WireFormatLite::WIRETYPE_END_GROUP)));
+                input.DecrementRecursionDepth();
+            }
+            else
+            {
+                int length = 0;
+                PROTO_DO(input.ReadVarintSizeAsInt(&length));
+                CodedInputStream::Limit limit = input.PushLimit(length);
+                PROTO_DO(input.IncrementRecursionDepth());
+                PROTO_DO(read_fields(input, field->message, L, table, true));
+                PROTO_DO(input.ConsumedEntireMessage());
+                input.DecrementRecursionDepth();
+                input.PopLimit(limit);
+            }
+            lua_pop(L, 1);
+            return true;
+        }
+        lua_pop(L, 1);
+    }
+
+    PROTO_DO(field->read(input, field, L));
+    field_store(L, index, names, field);
+    return true;
+}
+
+bool read_repeated(CodedInputStream& input, const FieldPlan* field, uint32 tag, lua_State* L, int index, int names)
+{
+    if (g_options.array && field->array != ARRAY_NONE)
+        return read_array(input, field, tag, L, index, names);
+
+    read_container(field, L, index, names);
+    int table = lua_gettop(L);
+    int count = container_size(L, table);
+
+    if (tag == field->packed_tag && field->packable)
+    {
+        int length = 0;
+        PROTO_DO(input.ReadVarintSizeAsInt(&length));
+        CodedInputStream::Limit limit = input.PushLimit(length);
+        while (input.BytesUntilLimit() > 0)
+        {
+            PROTO_DO(field->read(input, field, L));
+            lua_rawseti(L, table, ++count);
+        }
+        input.PopLimit(limit);
+    }
+    else
+    {
+        PROTO_DO(field->read(input, field, L));
+        lua_rawseti(L, table, ++count);
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
+bool read_table(CodedInputStream& input, const FieldPlan* field, lua_State* L, int index, int names)
+{
+    if (field->intkey)
+        return read_intmap(input, field, L, index, names);
+
+    const FieldPlan* key = &field->message->fields[0];
+    const FieldPlan* value = &field->message->fields[1];
+
+    read_container(field, L, index, names);
+    int table = lua_gettop(L);
+
+    int length = 0;
+    PROTO_DO(input.ReadVarintSizeAsInt(&length));
+    CodedInputStream::Limit limit = input.PushLimit(length);
+
+    // absent key or value of a map entry mean the default one
+    int key_index = table + 1;
+    int value_index = table + 2;
+    lua_pushnil(L);
+    lua_pushnil(L);
+
+    while (true)
+    {
+        uint32 tag = input.ReadTag();
+        if (tag == 0)
+            break;
+
+        if (tag == key->tag)
+        {
+            PROTO_DO(key->read(input, key, L));
+            lua_replace(L, key_index);
+        }
+        else if (tag == value->tag)
+        {
+            PROTO_DO(value->read(input, value, L));
+            lua_replace(L, value_index);
+        }
+        else
+        {
+            PROTO_DO(WireFormatLite::SkipField(&input, tag));
+        }
+    }
+    PROTO_DO(input.ConsumedEntireMessage());
+    input.PopLimit(limit);
+
+    if (lua_isnil(L, key_index))
+    {
+        PROTO_DO(key->fill(key, L));
+        lua_replace(L, key_index);
+    }
+
+    if (lua_isnil(L, value_index))
+    {
+        PROTO_DO(value->fill(value, L));
+        lua_replace(L, value_index);
+    }
+
+    lua_rawset(L, table);
+    lua_pop(L, 1);
+    return true;
+}
+
+// the value of an integer field, a map key or an array element, read
+// without going through field->read
+inline bool read_integer(CodedInputStream& input, const FieldPlan* field, int64* value)
+{
+    uint32 value32 = 0;
+    uint64 value64 = 0;
+    switch (field->field->type())
+    {
+    case FieldDescriptor::TYPE_INT32:
+        PROTO_DO(input.ReadVarint32(&value32));
+        *value = (int32)value32;
+        return true;
+    case FieldDescriptor::TYPE_UINT32:
+        PROTO_DO(input.ReadVarint32(&value32));
+        *value = value32;
+        return true;
+    case FieldDescriptor::TYPE_SINT32:
+        PROTO_DO(input.ReadVarint32(&value32));
+        *value = WireFormatLite::ZigZagDecode32(value32);
+        return true;
+    case FieldDescriptor::TYPE_SINT64:
+        PROTO_DO(input.ReadVarint64(&value64));
+        *value = WireFormatLite::ZigZagDecode64(value64);
+        return true;
+    case FieldDescriptor::TYPE_FIXED32:
+        PROTO_DO(input.ReadLittleEndian32(&value32));
+        *value = value32;
+        return true;
+    case FieldDescriptor::TYPE_SFIXED32:
+        PROTO_DO(input.ReadLittleEndian32(&value32));
+        *value = (int32)value32;
+        return true;
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+        PROTO_DO(input.ReadLittleEndian64(&value64));
+        *value = (int64)value64;
+        return true;
+    default:
+        PROTO_DO(input.ReadVarint64(&value64));
+        *value = (int64)value64;
+        return true;
+    }
+}
+
+inline bool read_element(CodedInputStream& input, const FieldPlan* field, ProtoArray* array)
+{
+    if (field->array == ARRAY_FLOAT)
+    {
+        uint32 value = 0;
+        PROTO_DO(input.ReadLittleEndian32(&value));
+        return array->push_number(WireFormatLite::DecodeFloat(value));
+    }
+    if (field->array == ARRAY_DOUBLE)
+    {
+        uint64 value = 0;
+        PROTO_DO(input.ReadLittleEndian64(&value));
+        return array->push_number(WireFormatLite::DecodeDouble(value));
+    }
+
+    int64 value = 0;
+    PROTO_DO(read_integer(input, field, &value));
+    return array->push_integer(value);
+}
+
+// decode a packed varint run with the bulk kernels when all of it is in
+// the input buffer, false leaves it to read_element
+inline bool read_varints(CodedInputStream& input, const FieldPlan* field, ProtoArray* array, int length)
+{
+    const void* data = NULL;
+    int size = 0;
+    if (!input.GetDirectBufferPointer(&data, &size) || size < length || !array->reserve(length))
+        return false;
+
+    const VarintKernels* kernels = varint_kernels(g_options.simd);
+    ptrdiff_t count = array->width() == 4
+        ? kernels->decode32((const uint8_t*)data, length, (uint32_t*)array->tail(), field->varint)
+        : kernels->decode64((const uint8_t*)data, length, (uint64_t*)array->tail(), field->varint);
+    if (count < 0)
+        return false;
+    array->advance(count);
+    return true;
+}
+
+// read_repeated into a proto.array, a packed fixed width field is copied
+// as it is on a little endian host
+bool read_array(CodedInputStream& input, const FieldPlan* field, uint32 tag, lua_State* L, int index, int names)
+{
+    field_push(L, index, names, field);
+    ProtoArray* array = array_test(L, -1);
+    if (array == NULL)
+    {
+        lua_pop(L, 1);
+        array = array_new(L, field->array);
+        lua_pushvalue(L, -1);
+        field_store(L, index, names, field);
+    }
+
+    if (tag == field->packed_tag && field->packable)
+    {
+        int length = 0;
+        PROTO_DO(input.ReadVarintSizeAsInt(&length));
+        WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(field->tag);
+        bool fixed = wire_type == WireFormatLite::WIRETYPE_FIXED32 || wire_type == WireFormatLite::WIRETYPE_FIXED64;
+        if (fixed && array_little_endian())
+        {
+            // the length is from the wire, nothing is reserved for bytes
+            // the input doesn't have
+            const void* data = NULL;
+            int size = 0;
+            PROTO_ASSERT(length == 0 || (input.GetDirectBufferPointer(&data, &size) && size >= length));
+            size_t count = length / array->width();
+            PROTO_ASSERT(count * array->width() == (size_t)length);
+            PROTO_DO(array->reserve(count));
+            PROTO_DO(input.ReadRaw(array->tail(), length));
+            array->advance(count);
+        }
+        else if (!fixed && read_varints(input, field, array, length))
+        {
+            PROTO_DO(input.Skip(length));
+        }
+        else
+        {
+            CodedInputStream::Limit limit = input.PushLimit(length);
+            while (input.BytesUntilLimit() > 0)
+                PROTO_DO(read_element(input, field, array));
+            input.PopLimit(limit);
+        }
+    }
+    else
+    {
+        PROTO_DO(read_element(input, field, array));
+    }
+
+    lua_pop(L, 1);
+    return true;
+}
+
+// push a new table for an integer keyed map, the entries left in the
+// message are looked at first so keys 1..n get an array part that holds
+// them all, other maps a hash part of the right size
+bool read_dense_table(CodedInputStream& input, const FieldPlan* field, lua_State* L)
+{
+    const FieldPlan* key = &field->message->fields[0];
+    const void* data = NULL;
+    int size = 0;
+    int count = 0;
+    int64 max_key = 0;
+    bool dense = input.GetDirectBufferPointer(&data, &size);
+
+    CodedInputStream ahead((const uint8*)data, dense ? size : 0);
+    uint32 tag = field->tag;
+    while (dense && tag != 0)
+    {
+        if (tag == field->tag)
+        {
+            int length = 0;
+            PROTO_DO(ahead.ReadVarintSizeAsInt(&length));
+            CodedInputStream::Limit limit = ahead.PushLimit(length);
+            int64 key_value = 0;
+            uint32 entry_tag = 0;
+            while ((entry_tag = ahead.ReadTag()) != 0)
+            {
+                if (entry_tag == key->tag)
+                {
+                    PROTO_DO(read_integer(ahead, key, &key_value));
+                }
+                else
+                {
+                    PROTO_DO(WireFormatLite::SkipField(&ahead, entry_tag));
+                }
+            }
+            ahead.PopLimit(limit);
+
+            count++;
+            dense = key_value > 0;
+            max_key = key_value > max_key ? key_value : max_key;
+        }
+        else
+        {
+            dense = WireFormatLite::SkipField(&ahead, tag);
+        }
+        tag = ahead.ReadTag();
+    }
+
+    if (dense && max_key <= 2 * (int64)count)
+        lua_createtable(L, (int)max_key, 0);
+    else
+        lua_createtable(L, 0, count);
+    return true;
+}
+
+// read_table for a map keyed by an integer, the key stays off the stack
+// until the entry is stored
+bool read_intmap(CodedInputStream& input, const FieldPlan* field, lua_State* L, int index, int names)
+{
+    const FieldPlan* key = &field->message->fields[0];
+    const FieldPlan* value = &field->message->fields[1];
+
+    if (g_options.dense)
+    {
+        field_push(L, index, names, field);
+        if (lua_isnil(L, -1))
+        {
+            lua_pop(L, 1);
+            PROTO_DO(read_dense_table(input, field, L));
+            lua_pushvalue(L, -1);
+            field_store(L, index, names, field);
+        }
+    }
+    else
+    {
+        read_container(field, L, index, names);
+    }
+    int table = lua_gettop(L);
+
+    int length = 0;
+    PROTO_DO(input.ReadVarintSizeAsInt(&length));
+    CodedInputStream::Limit limit = input.PushLimit(length);
+
+    // absent key or value of a map entry mean the default one
+    int64 key_value = 0;
+    int value_index = table + 1;
+    lua_pushnil(L);
+
+    while (true)
+    {
+        uint32 tag = input.ReadTag();
+        if (tag == 0)
+            break;
+
+        if (tag == key->tag)
+        {
+            PROTO_DO(read_integer(input, key, &key_value));
+        }
+        else if (tag == value->tag)
+        {
+            PROTO_DO(value->read(input, value, L));
+            lua_replace(L, value_index);
+        }
+        else
+        {
+            PROTO_DO(WireFormatLite::SkipField(&input, tag));
+        }
+    }
+    PROTO_DO(input.ConsumedEntireMessage());
+    input.PopLimit(limit);
+
+    if (lua_isnil(L, value_index))
+    {
+        PROTO_DO(value->fill(value, L));
+        lua_replace(L, value_index);
+    }
+
+#if LUA_VERSION_NUM == 501
+    lua_pushint64(L, key_value);
+    lua_insert(L, value_index);
+    lua_rawset(L, table);
+#else
+    lua_rawseti(L, table, key_value);
+#endif
+    lua_pop(L, 1);
+    return true;
+}
+
+// fill a field of plan->absent that wasn't on the wire the same way
+// decode_message does, a sparse table leaves it to its metatable. the
+// stack slots of read_unpack are always filled
+bool read_absent(const FieldPlan* field, lua_State* L, int index, int names)
+{
+    if (field->label == PLAN_REQUIRED) {
+        proto_error("read_absent required field notFound, field=%s", field->field->full_name().c_str());
+        return false;
+    }
+
+    if (g_options.sparse && names != 0)
+        return true;
+
+    if (field->label == PLAN_REPEATED && g_options.array && field->array != ARRAY_NONE)
+        array_new(L, field->array);
+    else if (field->label == PLAN_MAP || field->label == PLAN_REPEATED)
+        lua_newtable(L);
+    else
+        PROTO_DO(field->fill(field, L));
+    field_store(L, index, names, field);
+    return true;
+}
+
+// read fields into the table at index until the end of the message or an
+// end group tag, the caller checks which one it was
+bool read_fields(CodedInputStream& input, const ProtoPlan* plan, lua_State* L, int index, bool merge)
+{
+    if (!lua_checkstack(L, 8)) {
+        proto_error("read_fields stack overflow, field=%s", plan->descriptor->full_name().c_str());
+        return false;
+    }
+
+    proto_push_names(plan, L);
+    PROTO_DO(read_wire(input, plan, L, index, lua_gettop(L), merge));
+    lua_pop(L, 1);
+    return true;
+}
+
+// read_fields with the names of plan at names, or into the stack slots
+// from index on with names 0
+bool read_wire(CodedInputStream& input, const ProtoPlan* plan, lua_State* L, int index, int names, bool merge)
+{
+    FieldMarks marks(plan->field_count);
+    OneofCases cases(plan->oneof_count);
+    while (true)
+    {
+        uint32 tag = input.ReadTag();
+        if (tag == 0 || WireFormatLite::GetTagWireType(tag) == WireFormatLite::WIRETYPE_END_GROUP)
+            break;
+
+        const FieldPlan* field = plan->find(WireFormatLite::GetTagFieldNumber(tag));
+        if (field == NULL || (tag != field->tag && !(tag == field->packed_tag && field->packable)))
+        {
+            PROTO_DO(WireFormatLite::SkipField(&input, tag));
+            continue;
+        }
+
+        PROTO_DO(read_field(input, field, tag, L, index, names));
+        marks.set(field->index);
+
+        // the last member of a oneof on the wire wins
+        if (field->oneof >= 0)
+        {
+            const FieldPlan* last = cases.get(field->oneof);
+            if (last && last != field)
+            {
+                lua_pushnil(L);
+                field_store(L, index, names, last);
+            }
+            cases.set(field->oneof, field);
+        }
+    }
+
+    if (!merge)
+    {
+        for (int i = 0; i < plan->absent_count; i++)
+        {
+            const FieldPlan* field = plan->absent[i];
+            if (!marks.test(field->index))
+                PROTO_DO(read_absent(field, L, index, names));
+        }
+    }
+    return true;
+}
+
+bool read_message(CodedInputStream& input, const ProtoPlan* plan, lua_State* L)
+{
+    if (!g_options.sparse)
+    {
+        lua_createtable(L, 0, plan->field_count);
+        return read_fields(input, plan, L, lua_gettop(L), false);
+    }
+
+    lua_newtable(L);
+    PROTO_DO(read_fields(input, plan, L, lua_gettop(L), false));
+    PROTO_DO(proto_push_defaults(plan, L));
+    lua_setmetatable(L, -2);
+    return true;
+}
+
+bool read_proto(const ProtoPlan* plan, lua_State* L, const char* input, size_t size)
+{
+    PROTO_ASSERT(size <= INT_MAX);
+    CodedInputStream stream((const uint8*)input, (int)size);
+    PROTO_DO(read_message(stream, plan, L));
+    return stream.ConsumedEntireMessage();
+}
+
+// the fields are read straight into a stack slot each, in plan->sorted
+// order, no table is made for the message itself
+bool read_unpack(const ProtoPlan* plan, lua_State* L, const char* input, size_t size)
+{
+    PROTO_ASSERT(size <= INT_MAX);
+    PROTO_DO(lua_checkstack(L, plan->field_count + 8));
+    int index = lua_gettop(L) + 1;
+    for (int i = 0; i < plan->field_count; i++)
+        lua_pushnil(L);
+
+    CodedInputStream stream((const uint8*)input, (int)size);
+    PROTO_DO(read_wire(stream, plan, L, index, 0, false));
+    return stream.ConsumedEntireMessage();
+}
+
+// a fresh table with every field at its default, nested messages included,
+// oneof members are left unset
+bool read_create(const ProtoPlan* plan, lua_State* L, int depth)
+{
+    if (depth > 100 || !lua_checkstack(L, 6)) {
+        proto_error("read_create too deep, proto=%s", plan->descriptor->full_name().c_str());
+        return false;
+    }
+
+    lua_createtable(L, 0, plan->field_count);
+    int index = lua_gettop(L);
+    proto_push_names(plan, L);
+    int names = lua_gettop(L);
+    for (int i = 0; i < plan->field_count; i++)
+    {
+        const FieldPlan* field = &plan->fields[i];
+        if (field->oneof >= 0)
+            continue;
+
+        plan_pushname(L, names, field);
+        if (field->label == PLAN_MAP || field->label == PLAN_REPEATED)
+            lua_newtable(L);
+        else if (field->message)
+            PROTO_DO(read_create(field->message, L, depth + 1))
+        else
+            PROTO_DO(field->fill(field, L))
+        lua_rawset(L, index);
+    }
+    lua_pop(L, 1);
+    return true;
+}
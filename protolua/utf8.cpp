@@ -0,0 +1,259 @@
+#include "utf8.h"
+#include "varint.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define UTF8_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define UTF8_SSE2
+#define UTF8_AVX2
+#else
+#define UTF8_SSE2 __attribute__((target("sse2")))
+#define UTF8_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// the byte after the character at data, null when it is malformed
+static inline const uint8_t* next_char(const uint8_t* data, const uint8_t* end)
+{
+    uint8_t lead = data[0];
+    size_t left = end - data;
+    if (lead < 0x80)
+        return data + 1;
+
+    // a continuation byte, or 0xc0 0xc1 which can only start overlong forms
+    if (lead < 0xc2)
+        return NULL;
+
+    if (lead < 0xe0)
+    {
+        if (left < 2 || (data[1] & 0xc0) != 0x80)
+            return NULL;
+        return data + 2;
+    }
+
+    if (lead < 0xf0)
+    {
+        if (left < 3 || (data[1] & 0xc0) != 0x80 || (data[2] & 0xc0) != 0x80)
+            return NULL;
+        // overlong, or a surrogate
+        if ((lead == 0xe0 && data[1] < 0xa0) || (lead == 0xed && data[1] > 0x9f))
+            return NULL;
+        return data + 3;
+    }
+
+    if (lead < 0xf5)
+    {
+        if (left < 4 || (data[1] & 0xc0) != 0x80 || (data[2] & 0xc0) != 0x80 || (data[3] & 0xc0) != 0x80)
+            return NULL;
+        // overlong, or past 0x10ffff
+        if ((lead == 0xf0 && data[1] < 0x90) || (lead == 0xf4 && data[1] > 0x8f))
+            return NULL;
+        return data + 4;
+    }
+    return NULL;
+}
+
+static bool scalar_valid(const uint8_t* data, size_t size)
+{
+    const uint8_t* end = data + size;
+    while (data < end)
+    {
+        // skip 8 ascii bytes at a time
+        if (end - data >= 8)
+        {
+            uint64_t bytes = 0;
+            memcpy(&bytes, data, 8);
+            if ((bytes & 0x8080808080808080ULL) == 0)
+            {
+                data += 8;
+                continue;
+            }
+        }
+
+        data = next_char(data, end);
+        if (data == NULL)
+            return false;
+    }
+    return true;
+}
+
+static const Utf8Kernel g_scalar = { "scalar", scalar_valid };
+
+#ifdef UTF8_X86
+
+static inline int lowest_bit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+// ascii is skipped 16 bytes at a time, a window with other characters
+// goes one character at a time
+UTF8_SSE2 static bool sse2_valid(const uint8_t* data, size_t size)
+{
+    const uint8_t* end = data + size;
+    while (end - data >= 16)
+    {
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)data));
+        const uint8_t* stop = data + 16;
+        data += mask == 0 ? 16 : lowest_bit(mask);
+        while (data < stop)
+        {
+            data = next_char(data, end);
+            if (data == NULL)
+                return false;
+        }
+    }
+    return scalar_valid(data, end - data);
+}
+
+static const Utf8Kernel g_sse2 = { "sse2", sse2_valid };
+
+// the lookup validator of keiser and lemire: every byte pair is classified
+// by three table lookups, on the high nibble of the first byte, its low
+// nibble and the high nibble of the second. the error bits they all agree
+// on are the faults of the pair
+enum
+{
+    TOO_SHORT = 1 << 0,     // lead byte not followed by a continuation
+    TOO_LONG = 1 << 1,      // continuation after ascii
+    OVERLONG_3 = 1 << 2,    // 0xe0 0x80..0x9f
+    TOO_LARGE = 1 << 3,     // past 0x10ffff
+    SURROGATE = 1 << 4,     // 0xed 0xa0..0xbf
+    OVERLONG_2 = 1 << 5,    // 0xc0 0xc1
+    TOO_LARGE_1000 = 1 << 6,
+    OVERLONG_4 = 1 << 6,    // 0xf0 0x80..0x8f
+    TWO_CONTS = 1 << 7,     // continuation after continuation
+    CARRY = TOO_SHORT | TOO_LONG | TWO_CONTS,
+};
+
+static const uint8_t g_byte1_high[16] = {
+    TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+    TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+    TOO_SHORT | OVERLONG_2,
+    TOO_SHORT,
+    TOO_SHORT | OVERLONG_3 | SURROGATE,
+    TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4,
+};
+
+static const uint8_t g_byte1_low[16] = {
+    CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+    CARRY | OVERLONG_2,
+    CARRY,
+    CARRY,
+    CARRY | TOO_LARGE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+    CARRY | TOO_LARGE | TOO_LARGE_1000,
+};
+
+static const uint8_t g_byte2_high[16] = {
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+    TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+};
+
+// the 32 bytes ending n bytes before the end of input
+#define AVX2_PREV(input, prev, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - (n))
+
+UTF8_AVX2 static inline __m256i avx2_lookup(const uint8_t* table, __m256i nibbles)
+{
+    return _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)table)), nibbles);
+}
+
+// error bits of a block that follows prev
+UTF8_AVX2 static inline __m256i avx2_check(__m256i input, __m256i prev)
+{
+    const __m256i low = _mm256_set1_epi8(0x0f);
+    __m256i prev1 = AVX2_PREV(input, prev, 1);
+    __m256i faults = _mm256_and_si256(
+        _mm256_and_si256(avx2_lookup(g_byte1_high, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), low)),
+            avx2_lookup(g_byte1_low, _mm256_and_si256(prev1, low))),
+        avx2_lookup(g_byte2_high, _mm256_and_si256(_mm256_srli_epi16(input, 4), low)));
+
+    // the third and fourth bytes of a character are the continuations that
+    // the pair check flags as TWO_CONTS, they must be exactly those
+    __m256i third = _mm256_subs_epu8(AVX2_PREV(input, prev, 2), _mm256_set1_epi8((char)(0xe0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(AVX2_PREV(input, prev, 3), _mm256_set1_epi8((char)(0xf0 - 0x80)));
+    __m256i must = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must, faults);
+}
+
+// a block ending in the first bytes of a character, which the next block
+// has to finish, is above these
+#define AVX2_LAST _mm256_setr_epi8( \
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, \
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, \
+    (char)(0xf0 - 1), (char)(0xe0 - 1), (char)(0xc0 - 1))
+
+UTF8_AVX2 static inline void avx2_block(__m256i input, __m256i* prev, __m256i* error, __m256i* incomplete)
+{
+    if (_mm256_movemask_epi8(input) == 0)
+    {
+        // ascii can't finish what the block before started
+        *error = _mm256_or_si256(*error, *incomplete);
+        *incomplete = _mm256_setzero_si256();
+    }
+    else
+    {
+        *error = _mm256_or_si256(*error, avx2_check(input, *prev));
+        *incomplete = _mm256_subs_epu8(input, AVX2_LAST);
+    }
+    *prev = input;
+}
+
+UTF8_AVX2 static bool avx2_valid(const uint8_t* data, size_t size)
+{
+    const uint8_t* end = data + size;
+    __m256i error = _mm256_setzero_si256();
+    __m256i prev = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    for (; end - data >= 32; data += 32)
+    {
+        avx2_block(_mm256_loadu_si256((const __m256i*)data), &prev, &error, &incomplete);
+    }
+
+    if (data < end)
+    {
+        // zero padding is ascii
+        uint8_t tail[32] = { 0 };
+        memcpy(tail, data, end - data);
+        avx2_block(_mm256_loadu_si256((const __m256i*)tail), &prev, &error, &incomplete);
+    }
+
+    error = _mm256_or_si256(error, incomplete);
+    return _mm256_testz_si256(error, error) != 0;
+}
+
+static const Utf8Kernel g_avx2 = { "avx2", avx2_valid };
+
+#endif
+
+const Utf8Kernel* utf8_kernel(bool simd)
+{
+#ifdef UTF8_X86
+    static const Utf8Kernel* kernel = cpu_avx2() ? &g_avx2 : cpu_sse2() ? &g_sse2 : &g_scalar;
+    if (simd)
+        return kernel;
+#endif
+    return &g_scalar;
+}
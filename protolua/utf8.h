@@ -0,0 +1,18 @@
+#ifndef _JINJIAZHANG_PROTOUTF8_H_
+#define _JINJIAZHANG_PROTOUTF8_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// utf8 validation of proto3 string fields, with the same rules as
+// libprotobuf: no overlong forms, surrogates or code points past 0x10ffff
+struct Utf8Kernel
+{
+    const char* name;
+    bool (*valid)(const uint8_t* data, size_t size);
+};
+
+// the kernel of this cpu, or the scalar one when simd is false
+const Utf8Kernel* utf8_kernel(bool simd);
+
+#endif
@@ -0,0 +1,576 @@
+#include "varint.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define VARINT_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define VARINT_SSE2
+#define VARINT_AVX2
+#else
+#define VARINT_SSE2 __attribute__((target("sse2")))
+#define VARINT_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+
+// value of a decoded varint as the field sees it
+static inline uint32_t finish32(uint64_t value, VarintKind kind)
+{
+    uint32_t value32 = (uint32_t)value;
+    if (kind == VARINT_ZIGZAG)
+        return (value32 >> 1) ^ (0 - (value32 & 1));
+    return value32;
+}
+
+static inline uint64_t finish64(uint64_t value, VarintKind kind)
+{
+    if (kind == VARINT_ZIGZAG)
+        return (value >> 1) ^ (0 - (value & 1));
+    return value;
+}
+
+// varint written on the wire for a value of the field
+static inline uint64_t wire32(uint32_t value, VarintKind kind)
+{
+    if (kind == VARINT_ZIGZAG)
+        return (uint32_t)((value << 1) ^ (uint32_t)((int32_t)value >> 31));
+    if (kind == VARINT_SIGNED)
+        return (uint64_t)(int64_t)(int32_t)value;
+    return value;
+}
+
+static inline uint64_t wire64(uint64_t value, VarintKind kind)
+{
+    if (kind == VARINT_ZIGZAG)
+        return (value << 1) ^ (uint64_t)((int64_t)value >> 63);
+    return value;
+}
+
+static inline const uint8_t* get_varint(const uint8_t* data, const uint8_t* end, uint64_t* value)
+{
+    uint64_t result = 0;
+    for (int shift = 0; shift < 70 && data < end; shift += 7)
+    {
+        uint8_t byte = *data++;
+        result |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80)
+        {
+            *value = result;
+            return data;
+        }
+    }
+    return NULL;
+}
+
+static inline uint8_t* put_varint(uint8_t* out, uint64_t value)
+{
+    while (value >= 0x80)
+    {
+        *out++ = (uint8_t)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t)value;
+    return out;
+}
+
+static ptrdiff_t scalar_decode32(const uint8_t* data, size_t size, uint32_t* out, VarintKind kind)
+{
+    const uint8_t* end = data + size;
+    uint32_t* start = out;
+    while (data < end)
+    {
+        uint64_t value = 0;
+        data = get_varint(data, end, &value);
+        if (data == NULL)
+            return -1;
+        *out++ = finish32(value, kind);
+    }
+    return out - start;
+}
+
+static ptrdiff_t scalar_decode64(const uint8_t* data, size_t size, uint64_t* out, VarintKind kind)
+{
+    const uint8_t* end = data + size;
+    uint64_t* start = out;
+    while (data < end)
+    {
+        uint64_t value = 0;
+        data = get_varint(data, end, &value);
+        if (data == NULL)
+            return -1;
+        *out++ = finish64(value, kind);
+    }
+    return out - start;
+}
+
+static size_t scalar_encode32(const uint32_t* values, size_t count, uint8_t* out, VarintKind kind)
+{
+    uint8_t* start = out;
+    for (size_t i = 0; i < count; i++)
+        out = put_varint(out, wire32(values[i], kind));
+    return out - start;
+}
+
+static size_t scalar_encode64(const uint64_t* values, size_t count, uint8_t* out, VarintKind kind)
+{
+    uint8_t* start = out;
+    for (size_t i = 0; i < count; i++)
+        out = put_varint(out, wire64(values[i], kind));
+    return out - start;
+}
+
+static const VarintKernels g_scalar = { "scalar", scalar_decode32, scalar_decode64, scalar_encode32, scalar_encode64 };
+
+#ifdef VARINT_X86
+
+static inline int lowest_bit(uint32_t mask)
+{
+#ifdef _MSC_VER
+    unsigned long index = 0;
+    _BitScanForward(&index, mask);
+    return (int)index;
+#else
+    return __builtin_ctz(mask);
+#endif
+}
+
+static inline int highest_bit64(uint64_t value)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+    unsigned long index = 0;
+    _BitScanReverse64(&index, value);
+    return (int)index;
+#elif defined(_MSC_VER)
+    unsigned long index = 0;
+    if (_BitScanReverse(&index, (unsigned long)(value >> 32)))
+        return (int)index + 32;
+    _BitScanReverse(&index, (unsigned long)value);
+    return (int)index;
+#else
+    return 63 - __builtin_clzll(value);
+#endif
+}
+
+static inline uint64_t load64(const uint8_t* data)
+{
+    uint64_t value = 0;
+    memcpy(&value, data, 8);
+    return value;
+}
+
+// a varint of len <= 8 bytes out of the 8 bytes it starts with, without
+// looping over the bytes: the 7 bit groups are packed in three steps
+static inline uint64_t gather_varint(uint64_t bytes, int len)
+{
+    bytes &= ~0ULL >> (64 - len * 8);
+    bytes &= 0x7f7f7f7f7f7f7f7fULL;
+    bytes = (bytes & 0x007f007f007f007fULL) | ((bytes & 0x7f007f007f007f00ULL) >> 1);
+    bytes = (bytes & 0x00003fff00003fffULL) | ((bytes & 0x3fff00003fff0000ULL) >> 2);
+    bytes = (bytes & 0x000000000fffffffULL) | ((bytes & 0x0fffffff00000000ULL) >> 4);
+    return bytes;
+}
+
+// gather_varint the other way, value is below 2^56
+static inline uint64_t scatter_varint(uint64_t value, int len)
+{
+    value = (value & 0x000000000fffffffULL) | ((value & 0x00fffffff0000000ULL) << 4);
+    value = (value & 0x00003fff00003fffULL) | ((value & 0x0fffc0000fffc000ULL) << 2);
+    value = (value & 0x007f007f007f007fULL) | ((value & 0x3f803f803f803f80ULL) << 1);
+    return value | (0x8080808080808080ULL & ((1ULL << (8 * (len - 1))) - 1));
+}
+
+// put_varint without a loop, out has room for 8 bytes
+static inline uint8_t* put_varint8(uint8_t* out, uint64_t value)
+{
+    if (value >= (1ULL << 56))
+        return put_varint(out, value);
+
+    int len = (highest_bit64(value | 1) + 7) / 7;
+    uint64_t bytes = scatter_varint(value, len);
+    memcpy(out, &bytes, 8);
+    return out + len;
+}
+
+// every varint ending in a window of bytes at data, ends has a bit set
+// for each byte without the continuation bit. the 8 bytes at each varint
+// must be readable. gives the bytes used, 0 when nothing ends in the window
+template <class T, T (*finish)(uint64_t, VarintKind)>
+static inline size_t decode_window(const uint8_t* data, uint32_t ends, T** out, VarintKind kind)
+{
+    size_t pos = 0;
+    while (ends != 0)
+    {
+        size_t stop = lowest_bit(ends);
+        int len = (int)(stop - pos + 1);
+        uint64_t value = 0;
+        if (len <= 8)
+            value = gather_varint(load64(data + pos), len);
+        else if (get_varint(data + pos, data + stop + 1, &value) == NULL)
+            return 0;
+        *(*out)++ = finish(value, kind);
+        pos = stop + 1;
+        ends &= ends - 1;
+    }
+    return pos;
+}
+
+// 32 bit lanes of small varints as the field sees them
+VARINT_SSE2 static inline __m128i sse2_finish(__m128i values, VarintKind kind)
+{
+    if (kind != VARINT_ZIGZAG)
+        return values;
+    __m128i sign = _mm_sub_epi32(_mm_setzero_si128(), _mm_and_si128(values, _mm_set1_epi32(1)));
+    return _mm_xor_si128(_mm_srli_epi32(values, 1), sign);
+}
+
+VARINT_SSE2 static inline void sse2_store32(uint32_t* out, __m128i values)
+{
+    _mm_storeu_si128((__m128i*)out, values);
+}
+
+// sign extended, small varints are never negative unless zigzag made them so
+VARINT_SSE2 static inline void sse2_store64(uint64_t* out, __m128i values)
+{
+    __m128i sign = _mm_srai_epi32(values, 31);
+    _mm_storeu_si128((__m128i*)out, _mm_unpacklo_epi32(values, sign));
+    _mm_storeu_si128((__m128i*)(out + 2), _mm_unpackhi_epi32(values, sign));
+}
+
+// 16 bytes at a time: all single byte varints, eight two byte ones, or
+// whatever ends in them through decode_window
+template <class T, T (*finish)(uint64_t, VarintKind), void (*store)(T*, __m128i)>
+VARINT_SSE2 static ptrdiff_t sse2_decode(const uint8_t* data, size_t size, T* out, VarintKind kind)
+{
+    const uint8_t* end = data + size;
+    T* start = out;
+    __m128i zero = _mm_setzero_si128();
+    while (end - data >= 24)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i*)data);
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(bytes);
+        if (mask == 0)
+        {
+            __m128i low = _mm_unpacklo_epi8(bytes, zero);
+            __m128i high = _mm_unpackhi_epi8(bytes, zero);
+            store(out, sse2_finish(_mm_unpacklo_epi16(low, zero), kind));
+            store(out + 4, sse2_finish(_mm_unpackhi_epi16(low, zero), kind));
+            store(out + 8, sse2_finish(_mm_unpacklo_epi16(high, zero), kind));
+            store(out + 12, sse2_finish(_mm_unpackhi_epi16(high, zero), kind));
+            out += 16;
+            data += 16;
+        }
+        else if (mask == 0x5555)
+        {
+            __m128i low = _mm_and_si128(bytes, _mm_set1_epi16(0x7f));
+            __m128i high = _mm_slli_epi16(_mm_srli_epi16(bytes, 8), 7);
+            __m128i values = _mm_or_si128(low, high);
+            store(out, sse2_finish(_mm_unpacklo_epi16(values, zero), kind));
+            store(out + 4, sse2_finish(_mm_unpackhi_epi16(values, zero), kind));
+            out += 8;
+            data += 16;
+        }
+        else
+        {
+            size_t used = decode_window<T, finish>(data, ~mask & 0xffff, &out, kind);
+            if (used == 0)
+                return -1;
+            data += used;
+        }
+    }
+
+    while (data < end)
+    {
+        uint64_t value = 0;
+        data = get_varint(data, end, &value);
+        if (data == NULL)
+            return -1;
+        *out++ = finish(value, kind);
+    }
+    return out - start;
+}
+
+VARINT_SSE2 static ptrdiff_t sse2_decode32(const uint8_t* data, size_t size, uint32_t* out, VarintKind kind)
+{
+    return sse2_decode<uint32_t, finish32, sse2_store32>(data, size, out, kind);
+}
+
+VARINT_SSE2 static ptrdiff_t sse2_decode64(const uint8_t* data, size_t size, uint64_t* out, VarintKind kind)
+{
+    return sse2_decode<uint64_t, finish64, sse2_store64>(data, size, out, kind);
+}
+
+// eight 32 bit lanes that all take one byte, or all take two. false when
+// they don't and nothing was written
+VARINT_SSE2 static inline bool sse2_put_small(__m128i v0, __m128i v1, uint8_t** out)
+{
+    __m128i zero = _mm_setzero_si128();
+    __m128i any = _mm_or_si128(v0, v1);
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, _mm_set1_epi32(~0x7f)), zero)) == 0xffff)
+    {
+        __m128i words = _mm_packs_epi32(v0, v1);
+        _mm_storel_epi64((__m128i*)*out, _mm_packus_epi16(words, words));
+        *out += 8;
+        return true;
+    }
+
+    __m128i single = _mm_or_si128(_mm_cmpeq_epi32(_mm_and_si128(v0, _mm_set1_epi32(0x3f80)), zero),
+        _mm_cmpeq_epi32(_mm_and_si128(v1, _mm_set1_epi32(0x3f80)), zero));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, _mm_set1_epi32(~0x3fff)), zero)) == 0xffff
+        && _mm_movemask_epi8(single) == 0)
+    {
+        // low seven bits with the continuation bit, then the other seven
+        __m128i words = _mm_packs_epi32(v0, v1);
+        __m128i first = _mm_or_si128(_mm_and_si128(words, _mm_set1_epi16(0x7f)), _mm_set1_epi16(0x80));
+        __m128i second = _mm_slli_epi16(_mm_srli_epi16(words, 7), 8);
+        _mm_storeu_si128((__m128i*)*out, _mm_or_si128(first, second));
+        *out += 16;
+        return true;
+    }
+    return false;
+}
+
+// 8 values at a time
+VARINT_SSE2 static size_t sse2_encode32(const uint32_t* values, size_t count, uint8_t* out, VarintKind kind)
+{
+    uint8_t* start = out;
+    size_t i = 0;
+    for (; count - i >= 8; i += 8)
+    {
+        __m128i v0 = _mm_loadu_si128((const __m128i*)(values + i));
+        __m128i v1 = _mm_loadu_si128((const __m128i*)(values + i + 4));
+        if (kind == VARINT_ZIGZAG)
+        {
+            v0 = _mm_xor_si128(_mm_slli_epi32(v0, 1), _mm_srai_epi32(v0, 31));
+            v1 = _mm_xor_si128(_mm_slli_epi32(v1, 1), _mm_srai_epi32(v1, 31));
+        }
+
+        if (!sse2_put_small(v0, v1, &out))
+        {
+            for (size_t k = i; k < i + 8; k++)
+                out = put_varint8(out, wire32(values[k], kind));
+        }
+    }
+
+    for (; i < count; i++)
+        out = put_varint8(out, wire32(values[i], kind));
+    return out - start;
+}
+
+// 8 values at a time, narrowed to 32 bit lanes when they fit
+VARINT_SSE2 static size_t sse2_encode64(const uint64_t* values, size_t count, uint8_t* out, VarintKind kind)
+{
+    uint8_t* start = out;
+    __m128i zero = _mm_setzero_si128();
+    size_t i = 0;
+    for (; count - i >= 8; i += 8)
+    {
+        __m128i v[4];
+        for (int k = 0; k < 4; k++)
+        {
+            v[k] = _mm_loadu_si128((const __m128i*)(values + i + k * 2));
+            if (kind == VARINT_ZIGZAG)
+            {
+                __m128i sign = _mm_shuffle_epi32(_mm_srai_epi32(v[k], 31), _MM_SHUFFLE(3, 3, 1, 1));
+                v[k] = _mm_xor_si128(_mm_slli_epi64(v[k], 1), sign);
+            }
+        }
+
+        __m128i any = _mm_or_si128(_mm_or_si128(v[0], v[1]), _mm_or_si128(v[2], v[3]));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, _mm_set1_epi64x(~0xffffffffLL)), zero)) == 0xffff)
+        {
+            __m128i low = _mm_unpacklo_epi64(_mm_shuffle_epi32(v[0], _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(v[1], _MM_SHUFFLE(2, 0, 2, 0)));
+            __m128i high = _mm_unpacklo_epi64(_mm_shuffle_epi32(v[2], _MM_SHUFFLE(2, 0, 2, 0)), _mm_shuffle_epi32(v[3], _MM_SHUFFLE(2, 0, 2, 0)));
+            if (sse2_put_small(low, high, &out))
+                continue;
+        }
+
+        for (size_t k = i; k < i + 8; k++)
+            out = put_varint8(out, wire64(values[k], kind));
+    }
+
+    for (; i < count; i++)
+        out = put_varint8(out, wire64(values[i], kind));
+    return out - start;
+}
+
+static const VarintKernels g_sse2 = { "sse2", sse2_decode32, sse2_decode64, sse2_encode32, sse2_encode64 };
+
+VARINT_AVX2 static inline __m256i avx2_finish(__m256i values, VarintKind kind)
+{
+    if (kind != VARINT_ZIGZAG)
+        return values;
+    __m256i sign = _mm256_sub_epi32(_mm256_setzero_si256(), _mm256_and_si256(values, _mm256_set1_epi32(1)));
+    return _mm256_xor_si256(_mm256_srli_epi32(values, 1), sign);
+}
+
+VARINT_AVX2 static inline void avx2_store32(uint32_t* out, __m256i values)
+{
+    _mm256_storeu_si256((__m256i*)out, values);
+}
+
+VARINT_AVX2 static inline void avx2_store64(uint64_t* out, __m256i values)
+{
+    _mm256_storeu_si256((__m256i*)out, _mm256_cvtepi32_epi64(_mm256_castsi256_si128(values)));
+    _mm256_storeu_si256((__m256i*)(out + 4), _mm256_cvtepi32_epi64(_mm256_extracti128_si256(values, 1)));
+}
+
+// sse2_decode with 32 byte windows
+template <class T, T (*finish)(uint64_t, VarintKind), void (*store)(T*, __m256i)>
+VARINT_AVX2 static ptrdiff_t avx2_decode(const uint8_t* data, size_t size, T* out, VarintKind kind)
+{
+    const uint8_t* end = data + size;
+    T* start = out;
+    while (end - data >= 40)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i*)data);
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(bytes);
+        if (mask == 0)
+        {
+            for (int k = 0; k < 4; k++)
+            {
+                __m128i part = _mm_loadl_epi64((const __m128i*)(data + k * 8));
+                store(out + k * 8, avx2_finish(_mm256_cvtepu8_epi32(part), kind));
+            }
+            out += 32;
+            data += 32;
+        }
+        else if (mask == 0x55555555)
+        {
+            __m256i low = _mm256_and_si256(bytes, _mm256_set1_epi16(0x7f));
+            __m256i high = _mm256_slli_epi16(_mm256_srli_epi16(bytes, 8), 7);
+            __m256i values = _mm256_or_si256(low, high);
+            store(out, avx2_finish(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(values)), kind));
+            store(out + 8, avx2_finish(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(values, 1)), kind));
+            out += 16;
+            data += 32;
+        }
+        else
+        {
+            size_t used = decode_window<T, finish>(data, ~mask, &out, kind);
+            if (used == 0)
+                return -1;
+            data += used;
+        }
+    }
+
+    ptrdiff_t count = sizeof(T) == 4
+        ? sse2_decode32(data, end - data, (uint32_t*)out, kind)
+        : sse2_decode64(data, end - data, (uint64_t*)out, kind);
+    return count < 0 ? -1 : out - start + count;
+}
+
+VARINT_AVX2 static ptrdiff_t avx2_decode32(const uint8_t* data, size_t size, uint32_t* out, VarintKind kind)
+{
+    return avx2_decode<uint32_t, finish32, avx2_store32>(data, size, out, kind);
+}
+
+VARINT_AVX2 static ptrdiff_t avx2_decode64(const uint8_t* data, size_t size, uint64_t* out, VarintKind kind)
+{
+    return avx2_decode<uint64_t, finish64, avx2_store64>(data, size, out, kind);
+}
+
+// 16 values at a time when they all take one byte or all take two
+VARINT_AVX2 static size_t avx2_encode32(const uint32_t* values, size_t count, uint8_t* out, VarintKind kind)
+{
+    uint8_t* start = out;
+    __m256i zero = _mm256_setzero_si256();
+    size_t i = 0;
+    for (; count - i >= 16; i += 16)
+    {
+        __m256i v0 = _mm256_loadu_si256((const __m256i*)(values + i));
+        __m256i v1 = _mm256_loadu_si256((const __m256i*)(values + i + 8));
+        if (kind == VARINT_ZIGZAG)
+        {
+            v0 = _mm256_xor_si256(_mm256_slli_epi32(v0, 1), _mm256_srai_epi32(v0, 31));
+            v1 = _mm256_xor_si256(_mm256_slli_epi32(v1, 1), _mm256_srai_epi32(v1, 31));
+        }
+
+        // packs work within 128 bit lanes, the permute puts the words back in order
+        __m256i any = _mm256_or_si256(v0, v1);
+        __m256i words = _mm256_permute4x64_epi64(_mm256_packs_epi32(v0, v1), _MM_SHUFFLE(3, 1, 2, 0));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(any, _mm256_set1_epi32(~0x7f)), zero)) == -1)
+        {
+            __m128i bytes = _mm_packus_epi16(_mm256_castsi256_si128(words), _mm256_extracti128_si256(words, 1));
+            _mm_storeu_si128((__m128i*)out, bytes);
+            out += 16;
+            continue;
+        }
+
+        __m256i single = _mm256_or_si256(_mm256_cmpeq_epi32(_mm256_and_si256(v0, _mm256_set1_epi32(0x3f80)), zero),
+            _mm256_cmpeq_epi32(_mm256_and_si256(v1, _mm256_set1_epi32(0x3f80)), zero));
+        if (_mm256_movemask_epi8(_mm256_cmpeq_epi32(_mm256_and_si256(any, _mm256_set1_epi32(~0x3fff)), zero)) == -1
+            && _mm256_movemask_epi8(single) == 0)
+        {
+            __m256i first = _mm256_or_si256(_mm256_and_si256(words, _mm256_set1_epi16(0x7f)), _mm256_set1_epi16(0x80));
+            __m256i second = _mm256_slli_epi16(_mm256_srli_epi16(words, 7), 8);
+            _mm256_storeu_si256((__m256i*)out, _mm256_or_si256(first, second));
+            out += 32;
+            continue;
+        }
+
+        for (size_t k = i; k < i + 16; k++)
+            out = put_varint8(out, wire32(values[k], kind));
+    }
+
+    return out - start + sse2_encode32(values + i, count - i, out, kind);
+}
+
+static const VarintKernels g_avx2 = { "avx2", avx2_decode32, avx2_decode64, avx2_encode32, sse2_encode64 };
+
+bool cpu_avx2()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 0);
+    if (info[0] < 7)
+        return false;
+    __cpuid(info, 1);
+    // the os saves the ymm registers
+    if ((info[2] & (1 << 27)) == 0 || (_xgetbv(0) & 6) != 6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return (info[1] & (1 << 5)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+#endif
+}
+
+bool cpu_sse2()
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    return true;
+#elif defined(_MSC_VER)
+    int info[4];
+    __cpuid(info, 1);
+    return (info[3] & (1 << 26)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+#endif
+}
+
+#else
+
+bool cpu_avx2()
+{
+    return false;
+}
+
+bool cpu_sse2()
+{
+    return false;
+}
+
+#endif
+
+const VarintKernels* varint_kernels(bool simd)
+{
+#ifdef VARINT_X86
+    static const VarintKernels* kernels = cpu_avx2() ? &g_avx2 : cpu_sse2() ? &g_sse2 : &g_scalar;
+    if (simd)
+        return kernels;
+#endif
+    return &g_scalar;
+}
@@ -0,0 +1,37 @@
+#ifndef _JINJIAZHANG_PROTOVARINT_H_
+#define _JINJIAZHANG_PROTOVARINT_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+// how the integers of a packed run map to varints
+enum VarintKind
+{
+    VARINT_PLAIN,       // uint32, uint64 and int64
+    VARINT_SIGNED,      // int32, sign extended to 64 bits on the wire
+    VARINT_ZIGZAG,      // sint32 and sint64
+};
+
+// bulk varint kernels for packed repeated fields. they are picked once
+// from what the cpu supports, avx2 then sse2 then scalar code
+struct VarintKernels
+{
+    const char* name;
+    // decode the varints of [data, data + size) into out, which has room
+    // for size values. gives the count, -1 when the run is malformed
+    ptrdiff_t (*decode32)(const uint8_t* data, size_t size, uint32_t* out, VarintKind kind);
+    ptrdiff_t (*decode64)(const uint8_t* data, size_t size, uint64_t* out, VarintKind kind);
+    // encode count values into out, which has room for 10 bytes a value.
+    // gives the bytes written
+    size_t (*encode32)(const uint32_t* values, size_t count, uint8_t* out, VarintKind kind);
+    size_t (*encode64)(const uint64_t* values, size_t count, uint8_t* out, VarintKind kind);
+};
+
+// what the cpu supports, always false off x86
+bool cpu_avx2();
+bool cpu_sse2();
+
+// the kernels of this cpu, or the scalar ones when simd is false
+const VarintKernels* varint_kernels(bool simd);
+
+#endif
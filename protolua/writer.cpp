@@ -0,0 +1,548 @@
+#include "protolua.h"
+#include <limits.h>
+#include "google/protobuf/wire_format_lite.h"
+
+using namespace google::protobuf;
+using namespace google::protobuf::io;
+using namespace google::protobuf::internal;
+
+thread_local uintptr_t ScratchBuffer::owner_ = 0;
+thread_local ProtoBuffer ScratchBuffer::retained_buffer_;
+
+bool write_field(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index);
+bool write_repeated(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index);
+bool write_table(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index);
+bool write_intmap(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index);
+bool write_array(ProtoBuffer& buffer, const FieldPlan* field, ProtoArray* array);
+bool write_single(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index);
+bool write_message(ProtoBuffer& buffer, const ProtoPlan* plan, lua_State* L, int index);
+
+inline bool put_varint32(ProtoBuffer& buffer, uint32 value)
+{
+    PROTO_DO(buffer.reserve(5));
+    uint8* start = (uint8*)buffer.tail();
+    buffer.advance(CodedOutputStream::WriteVarint32ToArray(value, start) - start);
+    return true;
+}
+
+inline bool put_varint64(ProtoBuffer& buffer, uint64 value)
+{
+    PROTO_DO(buffer.reserve(10));
+    uint8* start = (uint8*)buffer.tail();
+    buffer.advance(CodedOutputStream::WriteVarint64ToArray(value, start) - start);
+    return true;
+}
+
+inline bool put_fixed32(ProtoBuffer& buffer, uint32 value)
+{
+    PROTO_DO(buffer.reserve(4));
+    uint8* start = (uint8*)buffer.tail();
+    buffer.advance(CodedOutputStream::WriteLittleEndian32ToArray(value, start) - start);
+    return true;
+}
+
+inline bool put_fixed64(ProtoBuffer& buffer, uint64 value)
+{
+    PROTO_DO(buffer.reserve(8));
+    uint8* start = (uint8*)buffer.tail();
+    buffer.advance(CodedOutputStream::WriteLittleEndian64ToArray(value, start) - start);
+    return true;
+}
+
+// reserve one byte for the length of a length-delimited record,
+// finish_length moves the body if the length needs more bytes
+inline bool begin_length(ProtoBuffer& buffer, size_t* mark)
+{
+    PROTO_DO(buffer.reserve(1));
+    *mark = buffer.size();
+    buffer.advance(1);
+    return true;
+}
+
+inline bool finish_length(ProtoBuffer& buffer, size_t mark)
+{
+    size_t length = buffer.size() - mark - 1;
+    PROTO_ASSERT(length <= INT_MAX);
+
+    int bytes = CodedOutputStream::VarintSize32((uint32)length);
+    if (bytes > 1)
+    {
+        PROTO_DO(buffer.reserve(bytes - 1));
+        char* body = buffer.data() + mark + 1;
+        memmove(body + bytes - 1, body, length);
+        buffer.advance(bytes - 1);
+    }
+    CodedOutputStream::WriteVarint32ToArray((uint32)length, (uint8*)buffer.data() + mark);
+    return true;
+}
+
+// proto3 scalars without presence are not serialized when they hold the
+// default value, which is exactly when every byte of the value is zero
+inline bool is_zero_bytes(const char* bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++)
+    {
+        if (bytes[i] != 0)
+            return false;
+    }
+    return true;
+}
+
+bool write_double(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_fixed64(buffer, WireFormatLite::EncodeDouble((double)lua_tonumber(L, index)));
+}
+
+bool write_float(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_fixed32(buffer, WireFormatLite::EncodeFloat((float)lua_tonumber(L, index)));
+}
+
+bool write_int64(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint64(buffer, (uint64)(int64)lua_toint64(L, index));
+}
+
+bool write_uint64(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint64(buffer, (uint64)lua_toint64(L, index));
+}
+
+bool write_int32(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint64(buffer, (uint64)(int64)(int32)lua_tointeger(L, index));
+}
+
+bool write_uint32(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint32(buffer, (uint32)lua_tointeger(L, index));
+}
+
+bool write_sint32(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint32(buffer, WireFormatLite::ZigZagEncode32((int32)lua_tointeger(L, index)));
+}
+
+bool write_sint64(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint64(buffer, WireFormatLite::ZigZagEncode64((int64)lua_toint64(L, index)));
+}
+
+bool write_fixed32(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_fixed32(buffer, (uint32)lua_tointeger(L, index));
+}
+
+bool write_fixed64(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_fixed64(buffer, (uint64)lua_toint64(L, index));
+}
+
+bool write_sfixed32(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_fixed32(buffer, (uint32)(int32)lua_tointeger(L, index));
+}
+
+bool write_sfixed64(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_fixed64(buffer, (uint64)(int64)lua_toint64(L, index));
+}
+
+bool write_bool(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint32(buffer, lua_toboolean(L, index) ? 1 : 0);
+}
+
+bool write_enum(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    return put_varint64(buffer, (uint64)(int64)(int)lua_tointeger(L, index));
+}
+
+bool write_string(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    size_t length = 0;
+    const char* bytes = NULL;
+    if (lua_type(L, index) == LUA_TSTRING)
+    {
+        bytes = lua_tolstring(L, index, &length);
+    }
+    else if (lua_type(L, index) == LUA_TNUMBER)
+    {
+        // convert a copy, lua_tolstring would change a key under lua_next
+        lua_pushvalue(L, index);
+        bytes = lua_tolstring(L, -1, &length);
+        bool ret = put_varint32(buffer, (uint32)length) && buffer.append(bytes, length);
+        lua_pop(L, 1);
+        return ret;
+    }
+
+    PROTO_ASSERT(length <= INT_MAX);
+    PROTO_DO(put_varint32(buffer, (uint32)length));
+    return buffer.append(bytes, length);
+}
+
+bool write_submessage(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    size_t mark = 0;
+    PROTO_DO(begin_length(buffer, &mark));
+    PROTO_DO(write_message(buffer, field->message, L, index));
+    return finish_length(buffer, mark);
+}
+
+bool write_group(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    PROTO_DO(write_message(buffer, field->message, L, index));
+    return put_varint32(buffer, WireFormatLite::MakeTag(field->number, WireFormatLite::WIRETYPE_END_GROUP));
+}
+
+PlanWrite write_handler(const FieldDescriptor* field)
+{
+    switch (field->type())
+    {
+    case FieldDescriptor::TYPE_DOUBLE:      return write_double;
+    case FieldDescriptor::TYPE_FLOAT:       return write_float;
+    case FieldDescriptor::TYPE_INT64:       return write_int64;
+    case FieldDescriptor::TYPE_UINT64:      return write_uint64;
+    case FieldDescriptor::TYPE_INT32:       return write_int32;
+    case FieldDescriptor::TYPE_FIXED64:     return write_fixed64;
+    case FieldDescriptor::TYPE_FIXED32:     return write_fixed32;
+    case FieldDescriptor::TYPE_BOOL:        return write_bool;
+    case FieldDescriptor::TYPE_STRING:      return write_string;
+    case FieldDescriptor::TYPE_GROUP:       return write_group;
+    case FieldDescriptor::TYPE_MESSAGE:     return write_submessage;
+    case FieldDescriptor::TYPE_BYTES:       return write_string;
+    case FieldDescriptor::TYPE_UINT32:      return write_uint32;
+    case FieldDescriptor::TYPE_ENUM:        return write_enum;
+    case FieldDescriptor::TYPE_SFIXED32:    return write_sfixed32;
+    case FieldDescriptor::TYPE_SFIXED64:    return write_sfixed64;
+    case FieldDescriptor::TYPE_SINT32:      return write_sint32;
+    case FieldDescriptor::TYPE_SINT64:      return write_sint64;
+    default:
+        proto_error("write_handler field unknow type, field=%s", field->full_name().c_str());
+        return NULL;
+    }
+}
+
+bool write_field(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    if (lua_isnil(L, index))
+    {
+        // the reflection path and the decoder reject it too
+        if (field->label == PLAN_REQUIRED)
+        {
+            proto_error("write_field required field nil, field=%s", field->field->full_name().c_str());
+            return false;
+        }
+        return true;
+    }
+
+    switch (field->label)
+    {
+    case PLAN_MAP:
+        return write_table(buffer, field, L, index);
+    case PLAN_REPEATED:
+        return write_repeated(buffer, field, L, index);
+    default:
+        return write_single(buffer, field, L, index);
+    }
+}
+
+bool write_repeated(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    ProtoArray* array = array_test(L, index);
+    if (array)
+        return write_array(buffer, field, array);
+
+    if (!lua_istable(L, index)) {
+        proto_error("write_repeated field isn't a table, field=%s", field->field->full_name().c_str());
+        return false;
+    }
+
+    int count = (int)luaL_len(L, index);
+    if (count == 0) {
+        return true;
+    }
+
+    if (field->packed)
+    {
+        size_t mark = 0;
+        PROTO_DO(put_varint32(buffer, field->packed_tag));
+        PROTO_DO(begin_length(buffer, &mark));
+        for (int i = 0; i < count; i++)
+        {
+            lua_geti(L, index, i + 1);
+            PROTO_DO(field->write(buffer, field, L, lua_absindex(L, -1)));
+            lua_pop(L, 1);
+        }
+        return finish_length(buffer, mark);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+        lua_geti(L, index, i + 1);
+        PROTO_DO(put_varint32(buffer, field->tag));
+        PROTO_DO(field->write(buffer, field, L, lua_absindex(L, -1)));
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+bool write_table(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    if (!lua_istable(L, index)) {
+        proto_error("write_table field isn't a table, field=%s", field->field->full_name().c_str());
+        return false;
+    }
+
+    if (field->intkey)
+        return write_intmap(buffer, field, L, index);
+
+    const FieldPlan* key = &field->message->fields[0];
+    const FieldPlan* value = &field->message->fields[1];
+
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        size_t mark = 0;
+        PROTO_DO(put_varint32(buffer, field->tag));
+        PROTO_DO(begin_length(buffer, &mark));
+        PROTO_DO(put_varint32(buffer, key->tag));
+        PROTO_DO(key->write(buffer, key, L, lua_absindex(L, -2)));
+        PROTO_DO(put_varint32(buffer, value->tag));
+        PROTO_DO(value->write(buffer, value, L, lua_absindex(L, -1)));
+        PROTO_DO(finish_length(buffer, mark));
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+// the value of an integer field, a map key or an array element, written
+// without going through field->write
+inline bool put_integer(ProtoBuffer& buffer, const FieldPlan* field, int64 value)
+{
+    switch (field->field->type())
+    {
+    case FieldDescriptor::TYPE_INT32:
+        return put_varint64(buffer, (uint64)(int64)(int32)value);
+    case FieldDescriptor::TYPE_UINT32:
+        return put_varint32(buffer, (uint32)value);
+    case FieldDescriptor::TYPE_SINT32:
+        return put_varint32(buffer, WireFormatLite::ZigZagEncode32((int32)value));
+    case FieldDescriptor::TYPE_SINT64:
+        return put_varint64(buffer, WireFormatLite::ZigZagEncode64(value));
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_SFIXED32:
+        return put_fixed32(buffer, (uint32)value);
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED64:
+        return put_fixed64(buffer, (uint64)value);
+    default:
+        return put_varint64(buffer, (uint64)value);
+    }
+}
+
+inline bool put_element(ProtoBuffer& buffer, const FieldPlan* field, const ProtoArray* array, size_t i)
+{
+    if (field->array == ARRAY_FLOAT)
+        return put_fixed32(buffer, WireFormatLite::EncodeFloat((float)array->get_number(i)));
+    if (field->array == ARRAY_DOUBLE)
+        return put_fixed64(buffer, WireFormatLite::EncodeDouble(array->get_number(i)));
+    return put_integer(buffer, field, array->get_integer(i));
+}
+
+// write_repeated from a proto.array, a packed fixed width field holding
+// the same element type is copied as it is on a little endian host
+bool write_array(ProtoBuffer& buffer, const FieldPlan* field, ProtoArray* array)
+{
+    if (field->array == ARRAY_NONE) {
+        proto_error("write_array field isn't numeric, field=%s", field->field->full_name().c_str());
+        return false;
+    }
+
+    size_t count = array->size();
+    if (!field->packed)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            PROTO_DO(put_varint32(buffer, field->tag));
+            PROTO_DO(put_element(buffer, field, array, i));
+        }
+        return true;
+    }
+
+    if (count == 0)
+        return true;
+
+    WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(field->tag);
+    bool fixed = wire_type == WireFormatLite::WIRETYPE_FIXED32 || wire_type == WireFormatLite::WIRETYPE_FIXED64;
+    if (fixed && array->type() == field->array && array_little_endian())
+    {
+        size_t length = count * array->width();
+        PROTO_ASSERT(length <= INT_MAX);
+        PROTO_DO(put_varint32(buffer, field->packed_tag));
+        PROTO_DO(put_varint32(buffer, (uint32)length));
+        return buffer.append(array->data(), length);
+    }
+
+    size_t mark = 0;
+    PROTO_DO(put_varint32(buffer, field->packed_tag));
+    PROTO_DO(begin_length(buffer, &mark));
+    if (!fixed && array->type() == field->array)
+    {
+        // the bulk kernels write at most 10 bytes a value
+        const VarintKernels* kernels = varint_kernels(g_options.simd);
+        PROTO_DO(buffer.reserve(count * 10));
+        uint8* out = (uint8*)buffer.tail();
+        buffer.advance(array->width() == 4
+            ? kernels->encode32((const uint32_t*)array->data(), count, out, field->varint)
+            : kernels->encode64((const uint64_t*)array->data(), count, out, field->varint));
+        return finish_length(buffer, mark);
+    }
+
+    for (size_t i = 0; i < count; i++)
+        PROTO_DO(put_element(buffer, field, array, i));
+    return finish_length(buffer, mark);
+}
+
+// a map entry with an integer key and a value that isn't length delimited
+// is at most 22 bytes, so its length always fits the one byte begin_length
+// reserved and finish_length has nothing to do
+bool write_intmap(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    const FieldPlan* key = &field->message->fields[0];
+    const FieldPlan* value = &field->message->fields[1];
+    bool bounded = WireFormatLite::GetTagWireType(value->tag) != WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+
+    lua_pushnil(L);
+    while (lua_next(L, index))
+    {
+        size_t mark = 0;
+        PROTO_DO(put_varint32(buffer, field->tag));
+        PROTO_DO(begin_length(buffer, &mark));
+        PROTO_DO(put_varint32(buffer, key->tag));
+        PROTO_DO(put_integer(buffer, key, (int64)lua_toint64(L, -2)));
+        PROTO_DO(put_varint32(buffer, value->tag));
+        PROTO_DO(value->write(buffer, value, L, lua_absindex(L, -1)));
+        if (bounded)
+            buffer.data()[mark] = (char)(buffer.size() - mark - 1);
+        else
+            PROTO_DO(finish_length(buffer, mark));
+        lua_pop(L, 1);
+    }
+    return true;
+}
+
+bool write_single(ProtoBuffer& buffer, const FieldPlan* field, lua_State* L, int index)
+{
+    size_t start = buffer.size();
+    PROTO_DO(put_varint32(buffer, field->tag));
+
+    size_t value = buffer.size();
+    PROTO_DO(field->write(buffer, field, L, index));
+
+    if (!field->presence && is_zero_bytes(buffer.data() + value, buffer.size() - value))
+        buffer.truncate(start);
+    return true;
+}
+
+bool write_message(ProtoBuffer& buffer, const ProtoPlan* plan, lua_State* L, int index)
+{
+    if (!lua_istable(L, index)) {
+        proto_error("write_message field isn't a table, field=%s", plan->descriptor->full_name().c_str());
+        return false;
+    }
+
+    if (!lua_checkstack(L, 8)) {
+        proto_error("write_message stack overflow, field=%s", plan->descriptor->full_name().c_str());
+        return false;
+    }
+
+    index = lua_absindex(L, index);
+    proto_push_names(plan, L);
+    int names = lua_gettop(L);
+
+    const FieldPlan* present[PLAN_SPARSE_MAX];
+    int count = proto_present(plan, L, index, names, present);
+    PROTO_ASSERT(count != PLAN_UNKNOWN);
+
+    const FieldPlan** fields = count == PLAN_DENSE ? plan->sorted : present;
+    if (count == PLAN_DENSE)
+        count = plan->field_count;
+
+    for (int i = 0; i < count; i++)
+    {
+        const FieldPlan* field = fields[i];
+        plan_pushname(L, names, field);
+        if (g_options.raw)
+            lua_rawget(L, index);
+        else
+            lua_gettable(L, index);
+        PROTO_DO(write_field(buffer, field, L, names + 1));
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+    return true;
+}
+
+// append to buffer, nothing is left behind on failure
+bool write_proto(const ProtoPlan* plan, lua_State* L, int index, ProtoBuffer& buffer)
+{
+    size_t start = buffer.size();
+    if (!write_message(buffer, plan, L, index))
+    {
+        buffer.truncate(start);
+        return false;
+    }
+    return true;
+}
+
+bool write_proto(const ProtoPlan* plan, lua_State* L, int index, char* output, size_t* size)
+{
+    if (output && size) // export to buffer
+    {
+        ProtoBuffer buffer(output, *size);
+        PROTO_DO(write_proto(plan, L, index, buffer));
+        *size = buffer.size();
+    }
+    else
+    {
+        ScratchBuffer scratch; // push to lua stack
+        ProtoBuffer& buffer = scratch.buffer();
+        PROTO_DO(write_proto(plan, L, index, buffer));
+        lua_pushlstring(L, buffer.data(), buffer.size());
+    }
+    return true;
+}
+
+bool write_pack(const ProtoPlan* plan, lua_State* L, int start, int end, ProtoBuffer& buffer)
+{
+    size_t origin = buffer.size();
+    for (int i = 0; i < plan->field_count && start + i <= end; i++)
+    {
+        const FieldPlan* field = plan->sorted[i];
+        if (!write_field(buffer, field, L, start + i))
+        {
+            buffer.truncate(origin);
+            return false;
+        }
+    }
+    return true;
+}
+
+bool write_pack(const ProtoPlan* plan, lua_State* L, int start, int end, char* output, size_t* size)
+{
+    if (output && size) // export to buffer
+    {
+        ProtoBuffer buffer(output, *size);
+        PROTO_DO(write_pack(plan, L, start, end, buffer));
+        *size = buffer.size();
+    }
+    else
+    {
+        ScratchBuffer scratch; // push to lua stack
+        ProtoBuffer& buffer = scratch.buffer();
+        PROTO_DO(write_pack(plan, L, start, end, buffer));
+        lua_pushlstring(L, buffer.data(), buffer.size());
+    }
+    return true;
+}